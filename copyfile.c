@@ -39,6 +39,17 @@
 #include <sys/attr.h>
 #include <sys/syscall.h>
 #include <sys/param.h>
+#include <aio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dispatch/dispatch.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
 #include <sys/paths.h>
 #include <sys/mount.h>
 #include <sys/acl.h>
@@ -85,6 +96,7 @@ static int qtn_file_set_flags(__unused void *x, __unused uint32_t flags) { retur
 #define XATTR_MAX_GET_RETRIES     3
 #define XATTR_MAX_GET_RSRC_SIZE   (1024 * 1024) // 1 MiB
 #define XATTR_ROOT_INSTALLED_NAME "com.apple.root.installed"
+#define XATTR_CHECKPOINT_NAME     "com.apple.copyfile.checkpoint" // private to copyfile_data()
 
 #define S_ISSUD                   (S_ISUID | S_ISGID) // Mask for setuid/setgid bits
 
@@ -108,6 +120,14 @@ enum cfInternalFlags {
 	cfDstCheckExistingSlinks  = 1 << 16, /* set if we should check for existing symlinks at the destination */
 	cfCheckFtsInfo            = 1 << 17, /* set if we should check our source file type against an FTSENT * */
 	cfCheckFtsInfoAsLink      = 1 << 18, /* set if cfCheckFtsInfo is set and the source is actually known to be a symlink */
+	cfPipelineData            = 1 << 19, /* set if data should be read ahead on another thread when copying across devices */
+	cfAdaptiveBsize           = 1 << 20, /* set if copyfile_data() should tune its I/O size */
+	cfNoCacheData             = 1 << 21, /* set if fcopyfile() should bypass the buffer cache like copyfile() */
+	cfStreamData              = 1 << 22, /* set if copyfile_data() should read ahead and drop behind through the cache */
+	cfStreamedData            = 1 << 23, /* set if the last data copy was made with cfStreamData */
+	cfCheckpointedData        = 1 << 24, /* set if dst holds a checkpoint of the data copied so far */
+	cfSkipZeros               = 1 << 25, /* set if copyfile_data() should leave holes for blocks of zeros */
+	cfConcurrentCallbacks     = 1 << 26, /* set if a parallel recursive copy may make callbacks from its workers */
 };
 
 #define COPYFILE_MNT_CPROTECT_MASK (cfSrcProtSupportValid | cfSrcSupportsCProtect | cfDstProtSupportValid | cfDstSupportsCProtect)
@@ -148,6 +168,29 @@ struct _copyfile_state
 	xattr_operation_intent_t copyIntent;
 	uint32_t src_bsize;
 	uint32_t dst_bsize;
+	uint32_t data_qdepth;
+	uint32_t data_threads;
+	off_t mmap_threshold;
+	uint32_t tuned_bsize;
+	off_t progress_bytes;
+	uint32_t progress_msecs;
+	off_t progress_last_copied;
+	uint64_t progress_last_time;
+	uint32_t checksum_alg;
+	uint32_t checksum;
+	off_t delta_written;
+	off_t checkpoint_bytes;
+	off_t resumed_offset;
+	copyfile_limiter_t limiter;
+	off_t range_src_offset;
+	off_t range_dst_offset;
+	off_t range_length;
+	uint32_t batch_threads;
+	struct copyfile_batch *batch;	// set if this copy is part of copyfile_batch()
+	void *batch_buffer;	// copyfile_data()'s buffer, kept for the next copy in the batch
+	size_t batch_buffer_size;
+	uint32_t recursive_threads;
+	struct copyfile_tree *tree;	// set if this file is part of a parallel copytree()
 };
 
 #define GET_PROT_CLASS(fd) fcntl((fd), F_GETPROTECTIONCLASS)
@@ -377,6 +420,9 @@ static int copyfile_preamble(copyfile_state_t *s, copyfile_flags_t flags);
 static int copyfile_internal(copyfile_state_t state, copyfile_flags_t flags);
 static int copyfile_unset_posix_fsec(filesec_t);
 static int copyfile_quarantine(copyfile_state_t);
+static copyfile_limiter_t copyfile_limiter_retain(copyfile_limiter_t);
+static void copyfile_limiter_release(copyfile_limiter_t);
+static int copyfile_data_parallel_copy(copyfile_state_t, int, int, off_t, off_t, size_t, size_t, bool, off_t *, bool *);
 
 #define COPYFILE_DEBUG (1<<31)
 #define COPYFILE_DEBUG_VAR "COPYFILE_DEBUG"
@@ -626,6 +672,359 @@ reset_security(copyfile_state_t s)
 	}
 }
 
+/*
+ * Copy an FTSENT (and its stat, into sb) for use after fts(3) has moved on,
+ * since fts reuses its own entries. There must be room after to for
+ * from's name. Returns -1 if the path could not be copied;
+ * a successful copy's fts_path must be freed.
+ * The entries it points to may be gone by the time the copy is used,
+ * so fts_parent, fts_link and fts_cycle are left NULL (as documented
+ * under COPYFILE_STATE_RECURSIVE_SRC_FTSENT).
+ */
+static int copyfile_ftsent_copy(FTSENT *to, struct stat *sb, const FTSENT *from)
+{
+	if ((to->fts_path = strdup(from->fts_path)) == NULL)
+		return -1;
+	memcpy(to->fts_name, from->fts_name, from->fts_namelen + 1);
+	to->fts_accpath = to->fts_path;
+	to->fts_pathlen = from->fts_pathlen;
+	to->fts_namelen = from->fts_namelen;
+	to->fts_level = from->fts_level;
+	to->fts_info = from->fts_info;
+	to->fts_errno = from->fts_errno;
+	to->fts_dev = from->fts_dev;
+	to->fts_ino = from->fts_ino;
+	to->fts_nlink = from->fts_nlink;
+	to->fts_number = from->fts_number;
+	to->fts_pointer = from->fts_pointer;
+	if (from->fts_statp) {
+		*sb = *from->fts_statp;
+		to->fts_statp = sb;
+	}
+	return 0;
+}
+
+/*
+ * A symbolic link that copytree() found, to be copied once
+ * everything else has been (see copytree()).
+ */
+struct copyfile_deferred_link {
+	struct copyfile_deferred_link *cdl_next;
+	struct stat	cdl_sb;
+	FTSENT		cdl_ent;	// must be last
+};
+
+/*
+ * Free a deferred link, and return the next one.
+ */
+static struct copyfile_deferred_link *copyfile_deferred_link_free(struct copyfile_deferred_link *link)
+{
+	struct copyfile_deferred_link *next;
+
+	if (link == NULL)
+		return NULL;
+	next = link->cdl_next;
+	free(link->cdl_ent.fts_path);
+	free(link);
+	return next;
+}
+
+/*
+ * Take the next deferred link off of links, freeing the last one taken (*link).
+ * Returns its FTSENT, or NULL once there are none left.
+ */
+static FTSENT *copyfile_deferred_link_next(struct copyfile_deferred_link **links,
+	struct copyfile_deferred_link **link)
+{
+	copyfile_deferred_link_free(*link);
+	if ((*link = *links) == NULL)
+		return NULL;
+	*links = (*link)->cdl_next;
+	return &(*link)->cdl_ent;
+}
+
+/*
+ * The most files a parallel recursive copy (COPYFILE_STATE_RECURSIVE_THREADS)
+ * copies at once, and the most file descriptors we assume each of them holds
+ * (the source and destination, and perhaps their resource forks).
+ */
+#define COPYFILE_TREE_MAX_THREADS	64
+#define COPYFILE_TREE_FDS_PER_COPY	4
+
+/*
+ * Shared state for a parallel recursive copy.
+ * copytree() walks the hierarchy, creating directories and copying
+ * everything but regular files itself; regular files are handed to
+ * workers. The files being copied in each directory are counted
+ * (by their fts_level), so that the directory's COPYFILE_RECURSE_DIR_CLEANUP
+ * pass is only made once all of them are done.
+ * Unless the caller allowed otherwise, callbacks are made one at a time,
+ * by whichever thread needs them, while holding ct_callback_lock.
+ */
+typedef struct copyfile_tree {
+	pthread_mutex_t	ct_lock;
+	pthread_cond_t	ct_cond;
+	pthread_mutex_t	ct_callback_lock;
+	copyfile_state_t ct_state;	// the caller's state
+	dispatch_group_t ct_group;
+	bool		ct_concurrent_callbacks;
+	uint32_t	ct_slots;	// the most files copied at once
+	// The fields below are protected by ct_lock.
+	uint32_t	ct_active;	// files being copied
+	uint32_t	*ct_pending;	// files being copied, by fts_level
+	size_t		ct_levels;
+	bool		ct_stop;	// a worker was told to (or had to) stop the copy
+	int		ct_errno;	// why it stopped
+} copyfile_tree_t;
+
+/*
+ * A regular file for a worker to copy. Its FTSENT is a snapshot
+ * (fts(3) reuses its own as soon as it moves on), followed by its name.
+ */
+struct copyfile_tree_job {
+	copyfile_tree_t	*ctj_tree;
+	copyfile_state_t ctj_state;
+	char		*ctj_dst;
+	copyfile_flags_t ctj_flags;
+	struct stat	ctj_sb;
+	FTSENT		ctj_ent;	// must be last
+};
+
+/*
+ * Wait until *count is at most limit, or the copy is stopped.
+ * Returns false if it has been stopped.
+ */
+static bool copyfile_tree_wait(copyfile_tree_t *t, const uint32_t *count, uint32_t limit)
+{
+	bool stop;
+
+	pthread_mutex_lock(&t->ct_lock);
+	while (*count > limit && !t->ct_stop)
+		pthread_cond_wait(&t->ct_cond, &t->ct_lock);
+	stop = t->ct_stop;
+	pthread_mutex_unlock(&t->ct_lock);
+
+	return !stop;
+}
+
+/*
+ * Wait until all of the files being copied at the given fts_level are done.
+ */
+static bool copyfile_tree_wait_level(copyfile_tree_t *t, short level)
+{
+	static const uint32_t none = 0;
+	const uint32_t *count = &none;
+
+	pthread_mutex_lock(&t->ct_lock);
+	// (ct_pending is only reallocated by the walking thread, which is us.)
+	if ((size_t) level < t->ct_levels)
+		count = &t->ct_pending[level];
+	pthread_mutex_unlock(&t->ct_lock);
+
+	return copyfile_tree_wait(t, count, 0);
+}
+
+/*
+ * The status callback for the state of everything in a parallel recursive copy.
+ * Unless the caller allowed callbacks to be made concurrently, make it
+ * while holding ct_callback_lock, so that the caller still sees only one
+ * callback at a time (if not always from the thread that called copyfile()),
+ * and no thread waits on another except while one is being made.
+ */
+static int copyfile_tree_status(int what, int stage, copyfile_state_t state,
+	const char *src, const char *dst, void *ctx)
+{
+	copyfile_tree_t *t = state->tree;
+	int verdict, error;
+
+	if (t->ct_concurrent_callbacks)
+		return (*t->ct_state->statuscb)(what, stage, state, src, dst, ctx);
+
+	error = errno;
+	pthread_mutex_lock(&t->ct_callback_lock);
+	errno = error;
+	verdict = (*t->ct_state->statuscb)(what, stage, state, src, dst, ctx);
+	error = errno;
+	pthread_mutex_unlock(&t->ct_callback_lock);
+	errno = error;
+
+	return verdict;
+}
+
+/*
+ * Stop a parallel recursive copy: no more files will be started.
+ */
+static void copyfile_tree_stop(copyfile_tree_t *t, int error)
+{
+	pthread_mutex_lock(&t->ct_lock);
+	if (!t->ct_stop) {
+		t->ct_stop = true;
+		t->ct_errno = error;
+	}
+	pthread_cond_broadcast(&t->ct_cond);
+	pthread_mutex_unlock(&t->ct_lock);
+}
+
+/*
+ * A worker: copy one regular file, with the same callbacks (and the same
+ * handling of their verdicts) as copytree() makes for files it copies itself.
+ */
+static void copyfile_tree_copy(struct copyfile_tree_job *job)
+{
+	copyfile_tree_t *t = job->ctj_tree;
+	copyfile_state_t tstate = job->ctj_state;
+	const char *src = job->ctj_ent.fts_path;
+	bool status = (t->ct_state->statuscb != NULL);
+	bool stop;
+	int rv;
+
+	pthread_mutex_lock(&t->ct_lock);
+	stop = t->ct_stop;
+	pthread_mutex_unlock(&t->ct_lock);
+
+	if (!stop) {
+		rv = copyfile(src, job->ctj_dst, tstate, job->ctj_flags);
+		if (rv < 0) {
+			if (status) {
+				rv = copyfile_tree_status(COPYFILE_RECURSE_FILE, COPYFILE_ERR, tstate, src, job->ctj_dst, tstate->ctx);
+				if (rv == COPYFILE_QUIT)
+					copyfile_tree_stop(t, errno);
+			} else {
+				copyfile_tree_stop(t, errno);
+			}
+		} else if (status) {
+			rv = copyfile_tree_status(COPYFILE_RECURSE_FILE, COPYFILE_FINISH, tstate, src, job->ctj_dst, tstate->ctx);
+			if (rv == COPYFILE_QUIT)
+				copyfile_tree_stop(t, 0);
+		}
+	}
+
+	copyfile_state_free(tstate);
+
+	pthread_mutex_lock(&t->ct_lock);
+	t->ct_pending[job->ctj_ent.fts_level]--;
+	t->ct_active--;
+	pthread_cond_broadcast(&t->ct_cond);
+	pthread_mutex_unlock(&t->ct_lock);
+
+	free(job->ctj_dst);
+	free(job->ctj_ent.fts_path);
+	free(job);
+}
+
+/*
+ * Hand a regular file (whose COPYFILE_START callback has been made)
+ * to a worker, once fewer than ct_slots files are being copied.
+ * The job takes over tstate and dst. Returns false if the copy has been stopped.
+ */
+static bool copyfile_tree_dispatch(copyfile_tree_t *t, const FTSENT *ftsent,
+	copyfile_state_t tstate, char *dst, copyfile_flags_t flags)
+{
+	struct copyfile_tree_job *job;
+	size_t level = (size_t) ftsent->fts_level;
+
+	if (!copyfile_tree_wait(t, &t->ct_active, t->ct_slots - 1))
+		return false;
+
+	job = calloc(1, sizeof(*job) + ftsent->fts_namelen + 1);
+	if (job == NULL || copyfile_ftsent_copy(&job->ctj_ent, &job->ctj_sb, ftsent) == -1) {
+		free(job);
+		copyfile_tree_stop(t, ENOMEM);
+		return false;
+	}
+	if (level >= t->ct_levels) {
+		uint32_t *pending;
+
+		// Workers update the counts as we move them.
+		pthread_mutex_lock(&t->ct_lock);
+		if ((pending = realloc(t->ct_pending, (level + 16) * sizeof(*pending))) != NULL) {
+			memset(pending + t->ct_levels, 0, (level + 16 - t->ct_levels) * sizeof(*pending));
+			t->ct_pending = pending;
+			t->ct_levels = level + 16;
+		}
+		pthread_mutex_unlock(&t->ct_lock);
+		if (pending == NULL) {
+			free(job->ctj_ent.fts_path);
+			free(job);
+			copyfile_tree_stop(t, ENOMEM);
+			return false;
+		}
+	}
+
+	job->ctj_tree = t;
+	job->ctj_dst = dst;
+	job->ctj_flags = flags;
+	job->ctj_state = tstate;
+	tstate->recurse_entry = &job->ctj_ent;
+
+	pthread_mutex_lock(&t->ct_lock);
+	t->ct_pending[level]++;
+	t->ct_active++;
+	pthread_mutex_unlock(&t->ct_lock);
+
+	dispatch_group_async(t->ct_group, dispatch_get_global_queue(qos_class_self(), 0), ^{
+		copyfile_tree_copy(job);
+	});
+	return true;
+}
+
+/*
+ * Set up a parallel recursive copy for s, if it asked for one,
+ * with no more workers than our file descriptor limit allows.
+ * Returns NULL if the copy should be made serially.
+ */
+static copyfile_tree_t *copyfile_tree_create(copyfile_state_t s)
+{
+	copyfile_tree_t *t;
+	uint32_t slots = MIN(s->recursive_threads, COPYFILE_TREE_MAX_THREADS);
+	struct rlimit rl;
+
+	// Leave at least half of our file descriptors to the caller and fts(3).
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		slots = (uint32_t) MIN((rlim_t) slots, rl.rlim_cur / 2 / COPYFILE_TREE_FDS_PER_COPY);
+	if (slots < 2)
+		return NULL;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return NULL;
+	pthread_mutex_init(&t->ct_lock, NULL);
+	pthread_cond_init(&t->ct_cond, NULL);
+	pthread_mutex_init(&t->ct_callback_lock, NULL);
+	t->ct_state = s;
+	t->ct_group = dispatch_group_create();
+	t->ct_concurrent_callbacks = (s->internal_flags & cfConcurrentCallbacks) != 0;
+	t->ct_slots = slots;
+
+	copyfile_debug(3, "copying up to %u files at once", slots);
+	return t;
+}
+
+/*
+ * Wait for every file still being copied, and tear down a parallel recursive copy.
+ * Returns the error that stopped it (0 if none did), or -1 if nothing did.
+ */
+static int copyfile_tree_destroy(copyfile_tree_t *t)
+{
+	int error = -1;
+
+	// Even a stopped copy has to wait for the files it had started.
+	pthread_mutex_lock(&t->ct_lock);
+	while (t->ct_active > 0)
+		pthread_cond_wait(&t->ct_cond, &t->ct_lock);
+	pthread_mutex_unlock(&t->ct_lock);
+	dispatch_group_wait(t->ct_group, DISPATCH_TIME_FOREVER);
+	dispatch_release(t->ct_group);
+
+	if (t->ct_stop)
+		error = t->ct_errno;
+	pthread_mutex_destroy(&t->ct_callback_lock);
+	pthread_cond_destroy(&t->ct_cond);
+	pthread_mutex_destroy(&t->ct_lock);
+	free(t->ct_pending);
+	free(t);
+	return error;
+}
+
 /*
  * copytree -- recursively copy a hierarchy.
  *
@@ -646,6 +1045,10 @@ reset_security(copyfile_state_t s)
  * regular files and symbolic links found in each directory.
  * Directories will still be copied normally.
  *
+ * If COPYFILE_STATE_RECURSIVE_THREADS is set, regular files are copied
+ * concurrently by workers (see copyfile_tree_t), while everything else
+ * is still copied in order as it is found.
+ *
  * XXX - no effort is made to handle overlapping hierarchies at the moment.
  *
  */
@@ -670,6 +1073,8 @@ copytree(copyfile_state_t s)
 	unsigned int flags = 0;
 	int fts_flags = FTS_NOCHDIR;
 	dev_t last_dev = s->sb.st_dev;
+	copyfile_tree_t *tree = NULL;
+	struct copyfile_deferred_link *links = NULL, **links_tail = &links, *link = NULL;
 
 	if (s == NULL) {
 		errno = EINVAL;
@@ -682,7 +1087,7 @@ copytree(copyfile_state_t s)
 		goto done;
 	}
 
-	flags = s->flags & (COPYFILE_ALL | COPYFILE_NOFOLLOW | COPYFILE_VERBOSE | COPYFILE_EXCL | COPYFILE_CLONE | COPYFILE_DATA_SPARSE);
+	flags = s->flags & (COPYFILE_ALL | COPYFILE_NOFOLLOW | COPYFILE_VERBOSE | COPYFILE_EXCL | COPYFILE_CLONE | COPYFILE_DATA_SPARSE | COPYFILE_DATA_DELTA);
 
 	paths[0] = src = s->src;
 	dst = s->dst;
@@ -789,45 +1194,60 @@ copytree(copyfile_state_t s)
 	}
 
 	/*
-	 * When symlinks are present, we'll skip copying them initially.
-	 * After we copy all other files, we'll go through the hierarchy
-	 * again, and only copy symlinks we see.
-	 * (If no symlinks are found, we only need one pass here.)
+	 * When symlinks are present, we'll skip copying them initially,
+	 * and only remember them as we see them.
+	 * After we copy all other files, we'll copy just those symlinks,
+	 * in the order we found them (rather than walk the hierarchy again).
 	 * This makes sure we properly handle the case that a symlink and
 	 * a directory have names that conflict on the destination.
-	 * (It's possible that we may see different symlinks in the second
-	 * pass than we would've seen earlier, or none at all.)
 	*/
 	status = s->statuscb;
-	bool need_second_pass = false;
+	if (s->recursive_threads > 1)
+		tree = copyfile_tree_create(s);
+	if (tree && status)
+		status = copyfile_tree_status;
+	fts = fts_open((char * const *)paths, fts_flags, NULL);
 	for (int directory_pass = 0; directory_pass < 2; directory_pass++) {
 
-		if (directory_pass && !need_second_pass) {;
+		if (directory_pass && links == NULL) {
 			break;
 		}
+		if (directory_pass && tree && !copyfile_tree_wait(tree, &tree->ct_active, 0)) {
+			// Symlinks must not be copied until every file is.
+			retval = -1;
+			goto done;
+		}
 
-		if (fts) {
+		if (directory_pass && fts) {
 			fts_close(fts);
+			fts = NULL;
 		}
-		fts = fts_open((char * const *)paths, fts_flags, NULL);
-
-		while ((ftsent = fts_read(fts)) != NULL) {
-			if (ftsent->fts_info == FTS_SL || ftsent->fts_info == FTS_SLNONE) {
-				if (directory_pass == 0) {
-					// We saw at least one symlink,
-					// so we'll need to iterate this directory again
-					// to copy it over.
-					// (Note that this may be triggered if the root directory
-					// is a symlink and we did not set FTS_COMFOLLOW above.)
-					need_second_pass = true;
-					continue;
+
+		while ((ftsent = directory_pass ? copyfile_deferred_link_next(&links, &link) : fts_read(fts)) != NULL) {
+			if (directory_pass == 0 && (ftsent->fts_info == FTS_SL || ftsent->fts_info == FTS_SLNONE)) {
+				// We'll copy this symlink after everything else.
+				// (Note that this may be triggered if the root directory
+				// is a symlink and we did not set FTS_COMFOLLOW above.)
+				struct copyfile_deferred_link *deferred;
+
+				deferred = calloc(1, sizeof(*deferred) + ftsent->fts_namelen + 1);
+				if (deferred == NULL || copyfile_ftsent_copy(&deferred->cdl_ent, &deferred->cdl_sb, ftsent) == -1) {
+					free(deferred);
+					errno = ENOMEM;
+					retval = -1;
+					goto done;
 				}
-			} else if (directory_pass) {
-				// Our second time around,
-				// we do not need to copy anything but symlinks.
+				*links_tail = deferred;
+				links_tail = &deferred->cdl_next;
 				continue;
 			}
 
+			// Stop if one of our workers was told to.
+			if (tree && !copyfile_tree_wait(tree, &tree->ct_active, UINT32_MAX)) {
+				retval = -1;
+				goto done;
+			}
+
 			int rv = 0;
 			char *dstfile = NULL;
 			int cmd = 0;
@@ -837,8 +1257,11 @@ copytree(copyfile_state_t s)
 				retval = -1;
 				goto done;
 			}
-			tstate->statuscb = s->statuscb;
+			tstate->statuscb = status;
+			tstate->tree = tree;
 			tstate->ctx = s->ctx;
+			// Every file in the hierarchy shares our I/O budget.
+			tstate->limiter = copyfile_limiter_retain(s->limiter);
 			// If asked to by our caller, make sure that we check for
 			// an already existing destination that is a symlink.
 			if (s->internal_flags & cfDstCheckExistingSlinks)
@@ -921,6 +1344,16 @@ copytree(copyfile_state_t s)
 						goto stopit;
 					}
 				}
+				if (tree && ftsent->fts_info == FTS_F) {
+					// A worker copies the file, and makes the rest of its callbacks.
+					if (!copyfile_tree_dispatch(tree, ftsent, tstate, dstfile, flags)) {
+						retval = -1;
+						goto stopit;
+					}
+					tstate = NULL;
+					dstfile = NULL;
+					goto skipit;
+				}
 				// Since we don't support cloning directories this code depends on copyfile()
 				// falling back to a regular directory copy.
 				int tmp_flags = (cmd == COPYFILE_RECURSE_DIR) ? (flags & ~COPYFILE_STAT) : flags;
@@ -947,6 +1380,11 @@ copytree(copyfile_state_t s)
 					}
 				}
 			} else if (cmd == COPYFILE_RECURSE_DIR_CLEANUP) {
+				// The directory's metadata must be set after all of its files are written.
+				if (tree && !copyfile_tree_wait_level(tree, ftsent->fts_level + 1)) {
+					retval = -1;
+					goto stopit;
+				}
 				if (status) {
 					rv = (*status)(cmd, COPYFILE_START, tstate, ftsent->fts_path, dstfile, s->ctx);
 					if (rv == COPYFILE_QUIT) {
@@ -988,8 +1426,10 @@ copytree(copyfile_state_t s)
 			}
 		skipit:
 		stopit:
-			s->internal_flags &= ~COPYFILE_MNT_CPROTECT_MASK;
-			s->internal_flags |= (tstate->internal_flags & COPYFILE_MNT_CPROTECT_MASK);
+			if (tstate) {
+				s->internal_flags &= ~COPYFILE_MNT_CPROTECT_MASK;
+				s->internal_flags |= (tstate->internal_flags & COPYFILE_MNT_CPROTECT_MASK);
+			}
 
 			copyfile_state_free(tstate);
 			free(dstfile);
@@ -999,10 +1439,27 @@ copytree(copyfile_state_t s)
 	}
 
 done:
+	if (tree) {
+		int error, saved_errno = errno;
+
+		// Wait for the files still being copied; if one of them stopped the copy, say why.
+		if (retval == -1)
+			copyfile_tree_stop(tree, saved_errno);
+		if ((error = copyfile_tree_destroy(tree)) != -1) {
+			retval = -1;
+			errno = error;
+		} else {
+			errno = saved_errno;
+		}
+		tree = NULL;
+	}
 	if (fts) {
 		fts_close(fts);
 		fts = NULL;
 	}
+	copyfile_deferred_link_free(link);
+	while (links != NULL)
+		links = copyfile_deferred_link_free(links);
 
 	copyfile_debug(1, "returning: %d errno %d\n", retval, errno);
 	return retval;
@@ -1065,6 +1522,11 @@ int fcopyfile(int src_fd, int dst_fd, copyfile_state_t state, copyfile_flags_t f
 	if (fstat(s->dst_fd, &dst_sb) < 0)
 		 dst_stat_ok = false;
 
+	if (s->internal_flags & cfNoCacheData) {
+		(void)fcntl(s->src_fd, F_NOCACHE, 1);
+		(void)fcntl(s->dst_fd, F_NOCACHE, 1);
+	}
+
 	(void)fchmod(s->dst_fd, (dst_sb.st_mode & ~S_IFMT) | (S_IRUSR | S_IWUSR));
 
 	(void)copyfile_quarantine(s);
@@ -1180,44 +1642,108 @@ static int copyfile_clone(copyfile_state_t state)
 }
 
 /*
- * Check if two provided paths are identical,
- * and if we're able to determine that, return true.
+ * State shared by the copies made by one call to copyfile_batch().
+ * Whatever we learn about a volume is kept in cb_volumes,
+ * so that we need only ask once.
+ */
+#define COPYFILE_BATCH_MAX_VOLUMES	16
+
+typedef struct copyfile_batch_volume {
+	dev_t		cbv_dev;
+	int		cbv_persistent_ids;	// -1 if we could not tell
+} copyfile_batch_volume_t;
+
+struct copyfile_batch {
+	copyfile_batch_item_t	*cb_items;
+	size_t		cb_count;
+	copyfile_state_t	cb_template;	// the caller's state, if any
+	copyfile_flags_t	cb_flags;
+	_Atomic size_t	cb_next_item;
+	pthread_mutex_t	cb_lock;	// protects the rest
+	off_t		cb_copied;
+	size_t		cb_nvolumes;
+	copyfile_batch_volume_t	cb_volumes[COPYFILE_BATCH_MAX_VOLUMES];
+};
+
+/*
+ * Return whether the volume holding path (on device dev) supports
+ * persistent file IDs, or -1 if we can't tell.
  */
-static bool copyfile_paths_identical(const char *src, const char *dst)
+static int copyfile_volume_has_persistent_ids(copyfile_state_t s, const char *path, dev_t dev)
 {
+	struct copyfile_batch *b = s ? s->batch : NULL;
 	struct attrlist attrs;
 	struct statfs sfs;
-	struct stat src_sb, dst_sb;
 	char volroot[MAXPATHLEN + 1];
 	struct {
 		uint32_t length;
 		vol_capabilities_attr_t volAttrs;
 	} volattrs;
-	char *real_src_path = NULL, *real_dst_path = NULL;
+	int persistent_ids = -1;
+
+	if (b != NULL) {
+		pthread_mutex_lock(&b->cb_lock);
+		for (size_t i = 0; i < b->cb_nvolumes; i++) {
+			if (b->cb_volumes[i].cbv_dev == dev) {
+				persistent_ids = b->cb_volumes[i].cbv_persistent_ids;
+				pthread_mutex_unlock(&b->cb_lock);
+				return persistent_ids;
+			}
+		}
+		pthread_mutex_unlock(&b->cb_lock);
+	}
 
-	// Common case: the destination does not exist.
-	if ((stat(dst, &dst_sb) == -1) || (stat(src, &src_sb) == -1))
-		return false;
+	if (statfs(path, &sfs) == 0) {
+		strlcpy(volroot, sfs.f_mntonname, sizeof(volroot));
+		memset(&attrs, 0, sizeof(attrs));
+		attrs.bitmapcount = ATTR_BIT_MAP_COUNT;
+		attrs.volattr = ATTR_VOL_CAPABILITIES;
 
-	// If both files exist, then we next try to check file IDs.
-	// This requires that the underlying filesystem support persistent file IDs.
-	if (statfs(src, &sfs) == -1)
-		return false;
+		if (getattrlist(volroot, &attrs, &volattrs, sizeof(volattrs), 0) == 0) {
+			persistent_ids =
+				(volattrs.volAttrs.capabilities[VOL_CAPABILITIES_FORMAT] & VOL_CAP_FMT_PERSISTENTOBJECTIDS) &&
+				(volattrs.volAttrs.valid[VOL_CAPABILITIES_FORMAT] & VOL_CAP_FMT_PERSISTENTOBJECTIDS);
+		}
+	}
 
-	strlcpy(volroot, sfs.f_mntonname, sizeof(volroot));
-	memset(&attrs, 0, sizeof(attrs));
-	attrs.bitmapcount = ATTR_BIT_MAP_COUNT;
-	attrs.volattr = ATTR_VOL_CAPABILITIES;
+	// (Only remember what we could find out.)
+	if (b != NULL && persistent_ids != -1) {
+		pthread_mutex_lock(&b->cb_lock);
+		if (b->cb_nvolumes < COPYFILE_BATCH_MAX_VOLUMES) {
+			b->cb_volumes[b->cb_nvolumes].cbv_dev = dev;
+			b->cb_volumes[b->cb_nvolumes].cbv_persistent_ids = persistent_ids;
+			b->cb_nvolumes++;
+		}
+		pthread_mutex_unlock(&b->cb_lock);
+	}
+
+	return persistent_ids;
+}
+
+/*
+ * Check if two provided paths are identical,
+ * and if we're able to determine that, return true.
+ */
+static bool copyfile_paths_identical(copyfile_state_t s, const char *src, const char *dst)
+{
+	struct stat src_sb, dst_sb;
+	char *real_src_path = NULL, *real_dst_path = NULL;
+	int persistent_ids;
 
-	if (getattrlist(volroot, &attrs, &volattrs, sizeof(volattrs), 0) == -1)
+	// Common case: the destination does not exist.
+	if ((stat(dst, &dst_sb) == -1) || (stat(src, &src_sb) == -1))
 		return false;
 
 	// If the underlying devices are not the same, then the files are not the same.
 	if (src_sb.st_dev != dst_sb.st_dev)
 		return false;
 
-	if ((volattrs.volAttrs.capabilities[VOL_CAPABILITIES_FORMAT] & VOL_CAP_FMT_PERSISTENTOBJECTIDS) &&
-		(volattrs.volAttrs.valid[VOL_CAPABILITIES_FORMAT] & VOL_CAP_FMT_PERSISTENTOBJECTIDS)) {
+	// If both files exist, then we next try to check file IDs.
+	// This requires that the underlying filesystem support persistent file IDs.
+	if ((persistent_ids = copyfile_volume_has_persistent_ids(s, src, src_sb.st_dev)) == -1)
+		return false;
+
+	if (persistent_ids) {
 		// The underlying source filesystem supports persistent file IDs,
 		// so if our two files have the same file ID on the same device,
 		// they are identical.
@@ -1306,7 +1832,7 @@ int copyfile(const char *src, const char *dst, copyfile_state_t state, copyfile_
 
 	if (!(s->flags & COPYFILE_CHECK)) {
 		// We have no work to do if `src` and `dst` point to the same place.
-		if (copyfile_paths_identical(src, dst)) {
+		if (copyfile_paths_identical(s, src, dst)) {
 			// ...but return an error if requested to do so.
 			if (s->flags & COPYFILE_EXCL) {
 				s->err = EEXIST;
@@ -1479,6 +2005,146 @@ error_exit:
 	goto exit;
 }
 
+/*
+ * Give a state the caller's settings from another,
+ * for a copy made on the caller's behalf.
+ */
+static int copyfile_state_inherit(copyfile_state_t s, copyfile_state_t from)
+{
+	const unsigned int inherited_flags = cfPipelineData | cfAdaptiveBsize | cfNoCacheData |
+		cfStreamData | cfSkipZeros | cfForbidCrossMount | cfAlwaysCopySuidBits |
+		cfDontSetCProtect | cfDstCheckExistingSlinks | cfConcurrentCallbacks;
+
+	s->statuscb = from->statuscb;
+	s->ctx = from->ctx;
+	s->debug = from->debug;
+	s->copyIntent = from->copyIntent;
+	s->src_bsize = from->src_bsize;
+	s->dst_bsize = from->dst_bsize;
+	s->data_qdepth = from->data_qdepth;
+	s->data_threads = from->data_threads;
+	s->mmap_threshold = from->mmap_threshold;
+	s->progress_bytes = from->progress_bytes;
+	s->progress_msecs = from->progress_msecs;
+	s->checksum_alg = from->checksum_alg;
+	s->checkpoint_bytes = from->checkpoint_bytes;
+	s->recursive_threads = from->recursive_threads;
+	s->limiter = copyfile_limiter_retain(from->limiter);
+	s->internal_flags |= (from->internal_flags & inherited_flags);
+	if (from->qinfo && (s->qinfo = qtn_file_clone(from->qinfo)) == NULL)
+		return -1;
+	return 0;
+}
+
+/*
+ * Copy the items of a batch, one after another, until there are none left.
+ * Each worker keeps its data buffer from one copy to the next.
+ */
+static void copyfile_batch_worker(struct copyfile_batch *b)
+{
+	void *buffer = NULL;
+	size_t buffer_size = 0;
+	size_t i;
+
+	while ((i = atomic_fetch_add(&b->cb_next_item, 1)) < b->cb_count) {
+		copyfile_batch_item_t *item = &b->cb_items[i];
+		copyfile_state_t s;
+		off_t copied = 0;
+		int ret;
+
+		if ((s = copyfile_state_alloc()) == NULL) {
+			item->result = errno;
+			continue;
+		}
+		if (b->cb_template && copyfile_state_inherit(s, b->cb_template) == -1) {
+			item->result = errno ? errno : ENOMEM;
+			copyfile_state_free(s);
+			continue;
+		}
+		s->batch = b;
+		s->batch_buffer = buffer;
+		s->batch_buffer_size = buffer_size;
+
+		ret = copyfile(item->from, item->to, s, b->cb_flags);
+		item->result = (ret < 0) ? (errno ? errno : EIO) : 0;
+		(void)copyfile_state_get(s, COPYFILE_STATE_COPIED, &copied);
+
+		buffer = s->batch_buffer;
+		buffer_size = s->batch_buffer_size;
+		s->batch_buffer = NULL;
+		copyfile_state_free(s);
+
+		pthread_mutex_lock(&b->cb_lock);
+		b->cb_copied += copied;
+		pthread_mutex_unlock(&b->cb_lock);
+	}
+
+	free(buffer);
+}
+
+/*
+ * Copy each of count items from their source to their destination,
+ * as copyfile() would with the given state (used as a template) and flags,
+ * sharing the work of setting up each copy among them all:
+ * what we learn about each volume, and the buffers the data is copied through.
+ * Each item's result is set to 0 if it was copied, or to the error if not;
+ * we return 0 if every item was copied, or -1 (with errno set to the
+ * first item's error) if not.
+ * If COPYFILE_STATE_BATCH_THREADS is set, that many items are copied at once.
+ */
+int copyfile_batch(copyfile_batch_item_t *items, size_t count, copyfile_state_t state, copyfile_flags_t flags)
+{
+	struct copyfile_batch b;
+	uint32_t nthreads = 1;
+
+	if (items == NULL && count > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.cb_items = items;
+	b.cb_count = count;
+	b.cb_template = state;
+	b.cb_flags = flags;
+	atomic_init(&b.cb_next_item, 0);
+	pthread_mutex_init(&b.cb_lock, NULL);
+
+	for (size_t i = 0; i < count; i++)
+		items[i].result = 0;
+
+	if (state != NULL && state->batch_threads > 1)
+		nthreads = (uint32_t) MIN((size_t) state->batch_threads, count);
+
+	if (nthreads > 1) {
+		dispatch_group_t group = dispatch_group_create();
+		struct copyfile_batch *bp = &b;
+
+		for (uint32_t i = 0; i < nthreads; i++) {
+			dispatch_group_async(group, dispatch_get_global_queue(qos_class_self(), 0), ^{
+				copyfile_batch_worker(bp);
+			});
+		}
+		dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+		dispatch_release(group);
+	} else {
+		copyfile_batch_worker(&b);
+	}
+
+	pthread_mutex_destroy(&b.cb_lock);
+	if (state != NULL)
+		state->totalCopied = b.cb_copied;
+
+	for (size_t i = 0; i < count; i++) {
+		if (items[i].result != 0) {
+			errno = items[i].result;
+			return -1;
+		}
+	}
+	errno = 0;
+	return 0;
+}
+
 /*
  * Shared prelude to the {f,}copyfile().  This initializes the
  * state variable, if necessary, and also checks for both debugging
@@ -1650,7 +2316,10 @@ static int copyfile_internal(copyfile_state_t s, copyfile_flags_t flags)
 		if ((ret = copyfile_data(s, false)) < 0)
 		{
 			copyfile_warn("error processing data");
-			if (s->dst && unlink(s->dst))
+			// If we recorded a checkpoint, keep what we copied so that it can be resumed;
+			// a range copy's destination holds more than the range, so keep it too.
+			if (s->dst && !(s->internal_flags & cfCheckpointedData) && s->range_length == 0 &&
+				unlink(s->dst))
 				copyfile_warn("%s: remove", s->src ? s->src : "(null src)");
 			goto exit;
 		}
@@ -1746,6 +2415,8 @@ int copyfile_state_free(copyfile_state_t s)
 			free(s->dst);
 		if (s->src)
 			free(s->src);
+		copyfile_limiter_release(s->limiter);
+		free(s->batch_buffer);
 		free(s);
 	}
 	return error;
@@ -2128,6 +2799,11 @@ static int copyfile_open(copyfile_state_t s)
 			oflags |= (writable_flags & s->flags) ? O_WRONLY : O_RDONLY;
 		}
 
+		// To update the destination in place, we need to read it, too.
+		if ((s->flags & (COPYFILE_DATA | COPYFILE_DATA_DELTA)) == (COPYFILE_DATA | COPYFILE_DATA_DELTA)) {
+			oflags = (oflags & ~O_WRONLY) | O_RDWR;
+		}
+
 		/*
 		 * COPYFILE_UNLINK tells us to try removing the destination
 		 * before we create it.  We don't care if the file doesn't
@@ -2264,7 +2940,11 @@ static int copyfile_open(copyfile_state_t s)
 					 * Set the flag here so we know to do it later.
 					 */
 					set_cprot_explicit = 1;
-					if (s->flags & (COPYFILE_PACK | COPYFILE_DATA))
+					// (If we are updating it in place, may resume an earlier copy to it,
+					// or are only copying a range into it, copyfile_data() will decide for itself.)
+					if ((s->flags & COPYFILE_PACK) || ((s->flags & COPYFILE_DATA) &&
+						!(s->flags & COPYFILE_DATA_DELTA) && s->checkpoint_bytes == 0 &&
+						s->range_length == 0))
 					{
 						copyfile_debug(4, "truncating existing file (%s)", s->dst);
 						oflags |= O_TRUNC;
@@ -2522,51 +3202,643 @@ static errno_t copyfile_set_bsdflags(copyfile_state_t s, const uint32_t new_flag
 }
 
 /*
- * Attempt to copy the data section of a file sparsely.
- * Requires that the source and destination file systems support sparse files.
- * Also requires that the source file descriptor's offset is a multiple of the smaller of the
- * source and destination file systems' block size.
- * In practice, this means that we refuse to perform copies that are only partially sparse.
- * Returns 0 if the source sparse file was copied, -1 on an unrecoverable error that
- * callers should propagate, and ENOTSUP where this routine refuses to copy the source file.
- * In this final case, callers are free to attempt a full copy.
+ * CRC32C (Castagnoli), as used for COPYFILE_CHECKSUM_CRC32C.
+ * We use the CPU's CRC32C instructions where we're built to have them,
+ * and a table otherwise.
  */
-static int copyfile_data_sparse(copyfile_state_t s, size_t input_blk_size, size_t output_blk_size)
+#define COPYFILE_CRC32C_POLY	0x82F63B78	// reflected
+
+#if !defined(__ARM_FEATURE_CRC32) && !defined(__SSE4_2__)
+static uint32_t copyfile_crc32c_table[256];
+
+static void copyfile_crc32c_table_init(__unused void *ctx)
 {
-	int src_fd = s->src_fd, dst_fd = s->dst_fd, rc = 0;
-	off_t src_start, dst_start, src_size = s->sb.st_size;
-	off_t first_hole_offset, next_hole_offset, current_src_offset, next_src_offset;
-	ssize_t nread;
-	size_t iosize = MIN(input_blk_size, output_blk_size);
-	copyfile_callback_t status = s->statuscb;
-	char *bp = NULL;
-	bool use_punchhole = true;
-	errno = 0;
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
 
-	// Sanity checks.
-	if (!(s->flags & COPYFILE_DATA_SPARSE)) {
-		// Don't attempt this unless the right flags are passed.
-		return ENOTSUP;
-	} else if (src_size < 0) {
-		// The file size of our source is invalid; there's nothing to copy.
-		errno = EINVAL;
-		goto error_exit;
-	} else if (src_size == 0) {
-		// This is a zero-length file: no work to do.
-		goto exit;
+		for (int k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ COPYFILE_CRC32C_POLY : crc >> 1;
+		copyfile_crc32c_table[i] = crc;
 	}
+}
+#endif
 
-	// Since a major underlying filesystem requires that holes are block-aligned,
-	// we only punch holes if we can guarantee that all holes from the source can
-	// be holes in the destination, which requires that the source filesystem's block size
-	// be an integral multiple of the destination filesystem's block size.
-	if (input_blk_size % output_blk_size != 0) {
-		use_punchhole = false;
+/*
+ * Continue the CRC32C crc (0 to begin with) over len bytes at buf.
+ */
+static uint32_t copyfile_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+#if defined(__ARM_FEATURE_CRC32)
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
 	}
+	for (; len > 0; len--)
+		crc = __crc32cb(crc, *p++);
+#elif defined(__SSE4_2__)
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+		uint64_t v;
 
-	// Get the starting src/dest file descriptor offsets.
-	src_start = lseek(src_fd, 0, SEEK_CUR);
-	dst_start = lseek(dst_fd, 0, SEEK_CUR);
+		memcpy(&v, p, sizeof(v));
+		crc = (uint32_t) _mm_crc32_u64(crc, v);
+	}
+	for (; len > 0; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+#else
+	static dispatch_once_t once;
+
+	dispatch_once_f(&once, NULL, copyfile_crc32c_table_init);
+	for (; len > 0; len--)
+		crc = copyfile_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+#endif
+	return ~crc;
+}
+
+/*
+ * Multiply a and b, polynomials over GF(2) modulo the CRC32C polynomial
+ * (in its reflected representation, where x^0 is the high bit).
+ */
+static uint32_t copyfile_crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ COPYFILE_CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/*
+ * Continue the CRC32C crc over len zero bytes, without having to
+ * feed them all through: doing so multiplies the (unconditioned) CRC
+ * by x^(8 * len), which we can compute by repeated squaring.
+ */
+static uint32_t copyfile_crc32c_zeros(uint32_t crc, uint64_t len)
+{
+	uint32_t xpow = 1U << 23;	// x^8
+	uint32_t p = 1U << 31;	// x^0
+
+	for (; len > 0; len >>= 1) {
+		if (len & 1)
+			p = copyfile_crc32c_multmodp(xpow, p);
+		xpow = copyfile_crc32c_multmodp(xpow, xpow);
+	}
+	return ~copyfile_crc32c_multmodp(p, ~crc);
+}
+
+/*
+ * Add len bytes at buf (or, if buf is NULL, len zero bytes,
+ * as read from a hole) to the checksum of the data being copied.
+ */
+static void copyfile_checksum_update(copyfile_state_t s, const void *buf, off_t len)
+{
+	if (s->checksum_alg != COPYFILE_CHECKSUM_CRC32C || len <= 0)
+		return;
+
+	if (buf == NULL)
+		s->checksum = copyfile_crc32c_zeros(s->checksum, (uint64_t) len);
+	else
+		s->checksum = copyfile_crc32c(s->checksum, buf, (size_t) len);
+}
+
+/*
+ * Make a COPYFILE_PROGRESS callback for the data copied so far.
+ * If the caller has asked for these callbacks to be coalesced
+ * (with COPYFILE_STATE_PROGRESS_BYTES or COPYFILE_STATE_PROGRESS_MSECS),
+ * only make one once enough data has been copied and enough time has passed
+ * since the last, or (if final is set) once the copy is complete and
+ * the last one did not already reflect everything that was written.
+ * Returns the callback's result, or COPYFILE_CONTINUE if none was made.
+ */
+static int copyfile_data_progress(copyfile_state_t s, bool final)
+{
+	const bool coalescing = (s->progress_bytes > 0 || s->progress_msecs > 0);
+	uint64_t now = 0;
+
+	if (s->statuscb == NULL)
+		return COPYFILE_CONTINUE;
+
+	if (coalescing) {
+		now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+		if (final) {
+			if (s->totalCopied == s->progress_last_copied)
+				return COPYFILE_CONTINUE;
+		} else if ((s->progress_bytes > 0 &&
+				s->totalCopied - s->progress_last_copied < s->progress_bytes) ||
+			(s->progress_msecs > 0 &&
+				now - s->progress_last_time < (uint64_t) s->progress_msecs * NSEC_PER_MSEC)) {
+			return COPYFILE_CONTINUE;
+		}
+	} else if (final) {
+		// Every write has already been reported.
+		return COPYFILE_CONTINUE;
+	}
+
+	s->progress_last_copied = s->totalCopied;
+	s->progress_last_time = now;
+	return (*s->statuscb)(COPYFILE_COPY_DATA, COPYFILE_PROGRESS, s, s->src, s->dst, s->ctx);
+}
+
+/*
+ * A resumable copy (see COPYFILE_STATE_CHECKPOINT_BYTES) periodically
+ * records how much of the source has safely reached the destination
+ * in an extended attribute on the destination, along with enough about
+ * the source to tell whether it has changed since.  The attribute is
+ * removed once the copy completes, and is never copied or removed by
+ * copyfile_xattr().
+ */
+#define COPYFILE_CHECKPOINT_VERSION	1
+
+typedef struct copyfile_checkpoint {
+	uint32_t	cc_version;
+	uint32_t	cc_checksum_alg;
+	uint32_t	cc_checksum;	// of the data before cc_offset
+	uint32_t	cc_reserved;
+	uint64_t	cc_dev;	// the source's identity...
+	uint64_t	cc_ino;
+	int64_t		cc_size;
+	int64_t		cc_mtime_sec;
+	int64_t		cc_mtime_nsec;
+	int64_t		cc_offset;	// ...and how much of it has been copied
+} copyfile_checkpoint_t;
+
+static void copyfile_checkpoint_fill(copyfile_state_t s, copyfile_checkpoint_t *cp, off_t offset)
+{
+	memset(cp, 0, sizeof(*cp));
+	cp->cc_version = COPYFILE_CHECKPOINT_VERSION;
+	cp->cc_checksum_alg = s->checksum_alg;
+	cp->cc_checksum = s->checksum;
+	cp->cc_dev = (uint64_t) s->sb.st_dev;
+	cp->cc_ino = (uint64_t) s->sb.st_ino;
+	cp->cc_size = (int64_t) s->sb.st_size;
+	cp->cc_mtime_sec = (int64_t) s->sb.st_mtimespec.tv_sec;
+	cp->cc_mtime_nsec = (int64_t) s->sb.st_mtimespec.tv_nsec;
+	cp->cc_offset = (int64_t) offset;
+}
+
+/*
+ * Record that the first offset bytes of the source have been copied.
+ * The data is flushed first, so that the checkpoint can never reach
+ * the disk ahead of the data it describes.
+ */
+static int copyfile_checkpoint_save(copyfile_state_t s, int dst_fd, off_t offset)
+{
+	copyfile_checkpoint_t cp;
+
+#ifdef F_BARRIERFSYNC
+	if (fcntl(dst_fd, F_BARRIERFSYNC) == -1 && fsync(dst_fd) == -1)
+#else
+	if (fsync(dst_fd) == -1)
+#endif
+		return -1;
+
+	copyfile_checkpoint_fill(s, &cp, offset);
+	if (fsetxattr(dst_fd, XATTR_CHECKPOINT_NAME, &cp, sizeof(cp), 0, 0) == -1)
+		return -1;
+
+	s->internal_flags |= cfCheckpointedData;
+	copyfile_debug(4, "checkpointed %lld bytes", (long long) offset);
+	return 0;
+}
+
+/*
+ * Find how much of the source an earlier, interrupted copy to this
+ * destination had copied, provided the source has not changed since
+ * (and we would compute the same checksum).  Returns 0 if there is
+ * no usable checkpoint.
+ */
+static off_t copyfile_checkpoint_load(copyfile_state_t s, int dst_fd)
+{
+	copyfile_checkpoint_t cp, expected;
+	struct stat dst_sb;
+
+	if (fgetxattr(dst_fd, XATTR_CHECKPOINT_NAME, &cp, sizeof(cp), 0, 0) != sizeof(cp))
+		return 0;
+
+	copyfile_checkpoint_fill(s, &expected, cp.cc_offset);
+	if (cp.cc_version != expected.cc_version || cp.cc_checksum_alg != expected.cc_checksum_alg ||
+		cp.cc_dev != expected.cc_dev || cp.cc_ino != expected.cc_ino || cp.cc_size != expected.cc_size ||
+		cp.cc_mtime_sec != expected.cc_mtime_sec || cp.cc_mtime_nsec != expected.cc_mtime_nsec) {
+		copyfile_debug(3, "ignoring checkpoint for a different or changed source");
+		return 0;
+	}
+
+	if (cp.cc_offset <= 0 || cp.cc_offset > cp.cc_size ||
+		fstat(dst_fd, &dst_sb) == -1 || cp.cc_offset > dst_sb.st_size) {
+		return 0;
+	}
+
+	s->checksum = cp.cc_checksum;
+	return (off_t) cp.cc_offset;
+}
+
+static void copyfile_checkpoint_clear(copyfile_state_t s, int dst_fd)
+{
+	(void)fremovexattr(dst_fd, XATTR_CHECKPOINT_NAME, 0);
+	s->internal_flags &= ~cfCheckpointedData;
+}
+
+/*
+ * A limiter caps the rate at which copies using it transfer data
+ * (COPYFILE_STATE_BYTES_PER_SEC) and make I/O requests (COPYFILE_STATE_IOPS),
+ * with a token bucket for each that holds up to COPYFILE_LIMITER_BURST_MSECS
+ * worth of tokens.  Each I/O takes its tokens up front, going into debt if
+ * there are not enough, and then sleeps until the debt would be repaid;
+ * so any number of copies, on any number of threads, can share one limiter
+ * (and its budget), each one waiting its turn.  Limiters are reference
+ * counted, and freed along with the last state using them.
+ */
+#define COPYFILE_LIMITER_BURST_MSECS	100
+
+struct _copyfile_limiter {
+	pthread_mutex_t	cl_lock;
+	_Atomic uint32_t	cl_refcount;
+	off_t		cl_bytes_per_sec;	// 0 for no limit
+	uint32_t	cl_iops;	// 0 for no limit
+	double		cl_byte_tokens;	// may be negative
+	double		cl_io_tokens;	// may be negative
+	uint64_t	cl_last_refill;
+};
+
+static copyfile_limiter_t copyfile_limiter_alloc(void)
+{
+	copyfile_limiter_t l = calloc(1, sizeof(*l));
+
+	if (l == NULL)
+		return NULL;
+	if (pthread_mutex_init(&l->cl_lock, NULL) != 0) {
+		free(l);
+		errno = ENOMEM;
+		return NULL;
+	}
+	atomic_init(&l->cl_refcount, 1);
+	l->cl_last_refill = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	return l;
+}
+
+static copyfile_limiter_t copyfile_limiter_retain(copyfile_limiter_t l)
+{
+	if (l != NULL)
+		atomic_fetch_add(&l->cl_refcount, 1);
+	return l;
+}
+
+static void copyfile_limiter_release(copyfile_limiter_t l)
+{
+	if (l != NULL && atomic_fetch_sub(&l->cl_refcount, 1) == 1) {
+		pthread_mutex_destroy(&l->cl_lock);
+		free(l);
+	}
+}
+
+// Change one of a limiter's rates; bytes_per_sec or iops is -1 to leave it alone.
+static void copyfile_limiter_set(copyfile_limiter_t l, off_t bytes_per_sec, int64_t iops)
+{
+	pthread_mutex_lock(&l->cl_lock);
+	if (bytes_per_sec >= 0) {
+		l->cl_bytes_per_sec = bytes_per_sec;
+		l->cl_byte_tokens = (double) bytes_per_sec * COPYFILE_LIMITER_BURST_MSECS / 1000;
+	}
+	if (iops >= 0) {
+		l->cl_iops = (uint32_t) iops;
+		l->cl_io_tokens = (double) iops * COPYFILE_LIMITER_BURST_MSECS / 1000;
+	}
+	pthread_mutex_unlock(&l->cl_lock);
+}
+
+// Read a limiter's rates (both 0 for no limiter).
+static void copyfile_limiter_get(copyfile_limiter_t l, off_t *bytes_per_sec, uint32_t *iops)
+{
+	*bytes_per_sec = 0;
+	*iops = 0;
+	if (l == NULL)
+		return;
+
+	pthread_mutex_lock(&l->cl_lock);
+	*bytes_per_sec = l->cl_bytes_per_sec;
+	*iops = l->cl_iops;
+	pthread_mutex_unlock(&l->cl_lock);
+}
+
+// Return whether a limiter (if any) currently limits anything.
+static bool copyfile_limiter_active(copyfile_limiter_t l)
+{
+	off_t bytes_per_sec;
+	uint32_t iops;
+
+	copyfile_limiter_get(l, &bytes_per_sec, &iops);
+	return bytes_per_sec > 0 || iops > 0;
+}
+
+/*
+ * Take the tokens for an I/O of the given number of bytes
+ * (or several, of that many bytes in total) from a bucket,
+ * returning how long to wait (in seconds) for them.
+ */
+static double copyfile_limiter_take(double *tokens, double rate, double elapsed, double amount)
+{
+	if (rate <= 0)
+		return 0;
+
+	*tokens = MIN(*tokens + elapsed * rate, rate * COPYFILE_LIMITER_BURST_MSECS / 1000) - amount;
+	return (*tokens < 0) ? -*tokens / rate : 0;
+}
+
+/*
+ * Wait until the state's limiter (if any) allows us to
+ * transfer this many bytes in this many I/O requests.
+ */
+static void copyfile_throttle(copyfile_state_t s, size_t bytes, uint32_t ios)
+{
+	copyfile_limiter_t l = s->limiter;
+	double wait;
+	uint64_t now;
+	int saved_errno;
+
+	if (l == NULL)
+		return;
+
+	pthread_mutex_lock(&l->cl_lock);
+	if (l->cl_bytes_per_sec == 0 && l->cl_iops == 0) {
+		pthread_mutex_unlock(&l->cl_lock);
+		return;
+	}
+	now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	const double elapsed = (double) (now - l->cl_last_refill) / NSEC_PER_SEC;
+	l->cl_last_refill = now;
+	wait = MAX(copyfile_limiter_take(&l->cl_byte_tokens, (double) l->cl_bytes_per_sec, elapsed, (double) bytes),
+		copyfile_limiter_take(&l->cl_io_tokens, (double) l->cl_iops, elapsed, (double) ios));
+	pthread_mutex_unlock(&l->cl_lock);
+
+	if (wait > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t) wait;
+		ts.tv_nsec = (long) ((wait - (double) ts.tv_sec) * NSEC_PER_SEC);
+		saved_errno = errno;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+		errno = saved_errno;
+	}
+}
+
+/*
+ * Return whether the len bytes at buf are all zero.
+ * Once the first few bytes are known to be zero, the rest can be
+ * compared with the buffer itself, shifted by that much:
+ * memcmp() is vectorized, and stops at the first difference.
+ */
+static bool copyfile_is_zero(const char *buf, size_t len)
+{
+	static const char zeros[16];
+
+	if (len <= sizeof(zeros))
+		return memcmp(buf, zeros, len) == 0;
+	return memcmp(buf, zeros, sizeof(zeros)) == 0 &&
+		memcmp(buf, buf + sizeof(zeros), len - sizeof(zeros)) == 0;
+}
+
+/*
+ * Return the length of the leading part of the len bytes at buf
+ * (to be written at offset) that is either made up entirely of
+ * aligned, hole_size blocks of zeros, setting *zeros, or contains
+ * no such blocks, clearing it.
+ */
+static size_t copyfile_zero_span(const char *buf, size_t len, off_t offset, size_t hole_size, bool *zeros)
+{
+	// Nothing before the first block boundary can become a hole.
+	size_t span = MIN(len, (hole_size - (size_t) (offset % (off_t) hole_size)) % hole_size);
+
+	*zeros = false;
+	while (span < len) {
+		size_t block = MIN(hole_size, len - span);
+		bool zero = (block == hole_size && copyfile_is_zero(buf + span, block));
+
+		if (span == 0)
+			*zeros = zero;
+		else if (zero != *zeros)
+			break;
+		span += block;
+	}
+	return span;
+}
+
+/*
+ * Return whether fd has nothing at or past offset (having just been truncated there,
+ * say), so that blocks of zeros copied there from on may be left unwritten as holes.
+ * Anywhere else, the old data would show through them instead.
+ */
+static bool copyfile_dst_unwritten_from(int fd, off_t offset)
+{
+	struct stat sb;
+
+	return fstat(fd, &sb) == 0 && sb.st_size <= offset;
+}
+
+/*
+ * Allocate a buffer for copying file data.
+ * The buffer is page-aligned: when the file descriptors have F_NOCACHE set
+ * (as copyfile() does), the kernel can then transfer page-aligned reads and writes
+ * directly between the device and our buffer, rather than first copying
+ * them through the unified buffer cache.
+ * (malloc() only guarantees 16-byte alignment for smaller allocations.)
+ * Release with free().
+ */
+static void *copyfile_data_buffer_alloc(size_t size)
+{
+	void *bp = NULL;
+	int error;
+
+	if ((error = posix_memalign(&bp, (size_t) getpagesize(), size)) != 0) {
+		errno = error;
+		return NULL;
+	}
+
+	return bp;
+}
+
+/*
+ * If supported, do preallocation for Xsan / HFS / apfs volumes:
+ * reserve enough space on dst_fd for bytes_needed bytes of data
+ * (less whatever it has allocated already), so that the file system
+ * can lay the file out in as few extents as it can, rather than
+ * extending it write by write. This is merely advisory.
+ * The space stays allocated to the file whether or not it is written,
+ * so copies that leave blocks of zeros unwritten to make holes of them
+ * (cfSkipZeros) must not reserve the source's full size: the serial copy
+ * reserves nothing then, and the sparse copy only what the source has allocated.
+ */
+static void copyfile_preallocate(copyfile_state_t s, int dst_fd, off_t bytes_needed)
+{
+#ifdef F_PREALLOCATE
+	off_t dst_bytes_allocated = 0;
+	struct stat dst_sb;
+	fstore_t fst;
+
+	if (fstat(dst_fd, &dst_sb) == 0) {
+		// The destination may already have
+		// preallocated space we can use.
+		dst_bytes_allocated = dst_sb.st_blocks * S_BLKSIZE;
+	}
+
+	if (dst_bytes_allocated >= bytes_needed)
+		return;
+
+	// Ask for all of it in one contiguous piece first,
+	// and if we can't have that, for whatever we can get.
+	fst.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+	fst.fst_posmode = F_PEOFPOSMODE;
+	fst.fst_offset = 0;
+	fst.fst_length = bytes_needed - dst_bytes_allocated;
+
+	copyfile_debug(3, "preallocating %lld bytes on destination", fst.fst_length);
+	if (fcntl(dst_fd, F_PREALLOCATE, &fst) == -1) {
+		fst.fst_flags = 0;
+		/* Ignore errors; this is merely advisory. */
+		(void)fcntl(dst_fd, F_PREALLOCATE, &fst);
+	}
+#else
+	(void)s;
+	(void)dst_fd;
+	(void)bytes_needed;
+#endif
+}
+
+/*
+ * A section of data in a sparse file, as found by SEEK_DATA and SEEK_HOLE.
+ */
+struct copyfile_extent {
+	off_t	ce_offset;
+	off_t	ce_length;
+};
+
+/*
+ * How many of the source's data sections copyfile_data_sparse() maps at once:
+ * enough that it rarely stops to map more, while bounding the memory it
+ * needs for sources with millions of them.
+ */
+#define COPYFILE_EXTENT_BATCH	256
+
+/*
+ * Map (up to max of) the data sections of fd from *offset up to end into extents,
+ * and advance *offset to where the next call should pick up.
+ * Returns how many were found (0 once there are no more), or -1 on error.
+ * This moves fd's offset.
+ */
+static ssize_t copyfile_extent_map(int fd, off_t *offset, off_t end, struct copyfile_extent *extents, size_t max)
+{
+	size_t count = 0;
+
+	while (count < max && *offset < end) {
+		off_t data, hole;
+
+		if ((data = lseek(fd, *offset, SEEK_DATA)) == -1) {
+			if (errno != ENXIO)
+				return -1;
+			// There are no more data sections.
+			data = end;
+		}
+		if (data >= end) {
+			*offset = end;
+			break;
+		}
+
+		// There is always a hole at EOF, so this can't fail with ENXIO.
+		if ((hole = lseek(fd, data, SEEK_HOLE)) == -1)
+			return -1;
+		hole = MIN(hole, end);
+
+		extents[count].ce_offset = data;
+		extents[count].ce_length = hole - data;
+		count++;
+		*offset = hole;
+	}
+
+	return (ssize_t) count;
+}
+
+/*
+ * Punch a hole of length bytes at offset in fd, whose file system's block size is blk_size.
+ * Only whole blocks can be punched, so the partial blocks at either end are left alone:
+ * the sparse copy only punches holes in the part of the destination it has just truncated,
+ * where they already read as zeros (and share their blocks with data being written anyway).
+ */
+static int copyfile_punch_hole(int fd, off_t offset, off_t length, size_t blk_size)
+{
+	struct fpunchhole punchhole_args;
+	off_t start = (off_t) roundup(offset, blk_size);
+	off_t end = offset + length - ((offset + length) % (off_t) blk_size);
+
+	if (end <= start)
+		return 0;
+
+	memset(&punchhole_args, 0, sizeof(punchhole_args));
+	punchhole_args.fp_offset = start;
+	punchhole_args.fp_length = end - start;
+	if (fcntl(fd, F_PUNCHHOLE, &punchhole_args) == -1) {
+		copyfile_warn("unable to punch hole in destination file, offset %lld length %lld",
+					  (long long) start, (long long) (end - start));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Attempt to copy the data section of a file sparsely.
+ * Requires that the source and destination file systems support sparse files.
+ * If the source file descriptor's offset is not a multiple of the smaller of the
+ * source and destination file systems' block size, the rest of that first block
+ * is copied densely; destination holes are only ever punched in whole blocks.
+ * Returns 0 if the source sparse file was copied, -1 on an unrecoverable error that
+ * callers should propagate, and ENOTSUP where this routine refuses to copy the source file.
+ * In this final case, callers are free to attempt a full copy.
+ */
+static int copyfile_data_sparse(copyfile_state_t s, const copyfile_bsizes_t *bsizes)
+{
+	int src_fd = s->src_fd, dst_fd = s->dst_fd, rc = 0;
+	off_t src_start, dst_start, src_size = s->sb.st_size;
+	off_t first_hole_offset, current_src_offset, dst_offset, extent_end;
+	off_t map_offset, hole_start;
+	off_t checksummed_offset = 0;
+	struct copyfile_extent extents[COPYFILE_EXTENT_BATCH];
+	ssize_t nread, nextents;
+	size_t input_blk_size = bsizes->cb_src_minbsize, output_blk_size = bsizes->cb_dst_minbsize;
+	size_t iosize = MIN(input_blk_size, output_blk_size);
+	// Block sizes only decide alignment; data is transferred in the full I/O size.
+	size_t xfersize = MAX(iosize, MAX(bsizes->cb_src_bsize, bsizes->cb_dst_bsize));
+	copyfile_callback_t status = s->statuscb;
+	char *bp = NULL;
+	bool use_punchhole = true, skip_zeros = false;
+	errno = 0;
+
+	// Sanity checks.
+	if (!(s->flags & COPYFILE_DATA_SPARSE)) {
+		// Don't attempt this unless the right flags are passed.
+		return ENOTSUP;
+	} else if (src_size < 0) {
+		// The file size of our source is invalid; there's nothing to copy.
+		errno = EINVAL;
+		goto error_exit;
+	} else if (src_size == 0) {
+		// This is a zero-length file: no work to do.
+		goto exit;
+	}
+
+	// Get the starting src/dest file descriptor offsets.
+	src_start = lseek(src_fd, 0, SEEK_CUR);
+	dst_start = lseek(dst_fd, 0, SEEK_CUR);
 	if (src_start < 0 || src_start >= src_size || dst_start < 0) {
 		/*
 		 * Invalid starting source/destination offset:
@@ -2579,13 +3851,10 @@ static int copyfile_data_sparse(copyfile_state_t s, size_t input_blk_size, size_
 		}
 		copyfile_warn("Invalid file descriptor offset, cannot perform a sparse copy");
 		goto error_exit;
-	} else if (src_start != (off_t) roundup(src_start, iosize) ||
-			   dst_start != (off_t) roundup(dst_start, iosize)) {
-		// If the starting offset isn't a multiple of the iosize, we can't do an entire sparse copy.
-		// Fall back to copyfile_data(), which will perform a full copy from the starting position.
-		return ENOTSUP;
 	}
 
+	checksummed_offset = src_start;
+
 	// Make sure that there is at least one hole in this [part of the] file.
 	first_hole_offset = lseek(src_fd, src_start, SEEK_HOLE);
 	if (first_hole_offset == -1 || first_hole_offset == src_size) {
@@ -2606,30 +3875,42 @@ static int copyfile_data_sparse(copyfile_state_t s, size_t input_blk_size, size_
 	if (ftruncate(dst_fd, dst_start) == -1) {
 		copyfile_warn("Could not zero destination file before copy");
 		goto error_exit;
-	} else if (ftruncate(dst_fd, dst_start + src_size - src_start) == -1) {
+	}
+	if (ftruncate(dst_fd, dst_start + src_size - src_start) == -1) {
 		copyfile_warn("Could not set destination file size before copy");
 		goto error_exit;
 	}
 
-	// Set the source's offset to the first data section.
-	current_src_offset = lseek(src_fd, src_start, SEEK_DATA);
-	if (current_src_offset == -1) {
-		if (errno == ENXIO) {
-			// There are no more data sections in the file, so there's nothing to copy.
-			goto set_total_copied;
+	// Holes take no space, so only reserve what the source has allocated
+	// (including anything it has preallocated but not yet written).
+	// If requested, also leave whole blocks of zeros within data sections unwritten:
+	// nothing is left past dst_start to show through them, and as the reservation
+	// still covers them, space the source had preallocated stays reserved.
+	copyfile_preallocate(s, dst_fd, MIN(s->sb.st_blocks * S_BLKSIZE, src_size - src_start));
+	skip_zeros = (s->internal_flags & cfSkipZeros) != 0;
+
+	// If we may, split the file among several workers, each of which
+	// maps and copies the data sections of its own ranges of the file.
+	// (Data written out of order can't be checksummed as it is written.)
+	if (s->data_threads > 1 && s->checksum_alg == COPYFILE_CHECKSUM_NONE && !copyfile_limiter_active(s->limiter) &&
+		src_start % (off_t) iosize == 0) {
+		off_t copied = 0;
+		bool skipped = false;
+
+		rc = copyfile_data_parallel_copy(s, src_fd, dst_fd, src_start, dst_start, xfersize, output_blk_size,
+			skip_zeros, &copied, &skipped);
+		if (rc == 0 && skipped) {
+			goto exit;
+		} else if (rc == 0) {
+			goto copied;
+		} else if (rc != ENOTSUP) {
+			goto error_exit;
 		}
-		goto error_exit;
-	}
-
-	// Now, current_src_offset points at the start of src's first data region.
-	// Update dst_fd to point to the same offset (respecting its start).
-	if (lseek(dst_fd, dst_start + current_src_offset - src_start, SEEK_SET) == -1) {
-		copyfile_warn("failed to set dst to first data section");
-		goto error_exit;
+		rc = 0;
 	}
 
 	// Allocate a temporary buffer to copy data sections into.
-	bp = malloc(iosize);
+	bp = copyfile_data_buffer_alloc(xfersize);
 	if (bp == NULL) {
 		copyfile_warn("No memory for copy buffer");
 		goto error_exit;
@@ -2637,255 +3918,1728 @@ static int copyfile_data_sparse(copyfile_state_t s, size_t input_blk_size, size_
 
 	/*
 	 * Performing a sparse copy:
-	 * While our source fd points to a data section (and is < EOF), read iosize bytes in.
-	 * Then, write those bytes to the dest fd, using the same iosize.
-	 * Finally, update our source and dest fds to point to the next data section.
+	 * Map the source's data sections a batch at a time, then walk that map,
+	 * copying each data section with positioned reads and writes of (up to) xfersize bytes,
+	 * and punching the hole between it and the previous one (if we can) in a single call.
+	 * The source is only probed twice per data section, and never re-walked.
 	 */
-	while ((nread = read(src_fd, bp, iosize)) > 0) {
-		ssize_t nwritten;
-		size_t left = nread;
-		void *ptr = bp;
-		int loop = 0;
+	map_offset = hole_start = src_start;
+	if (src_start % (off_t) iosize != 0) {
+		// If the source starts part way into a block, copy the rest of that block densely,
+		// and continue sparsely from the next block boundary.
+		map_offset = MIN((off_t) roundup(src_start, iosize), src_size);
+		extents[0].ce_offset = src_start;
+		extents[0].ce_length = map_offset - src_start;
+		nextents = 1;
+	} else {
+		nextents = copyfile_extent_map(src_fd, &map_offset, src_size, extents, COPYFILE_EXTENT_BATCH);
+	}
+	for (; nextents > 0; nextents = copyfile_extent_map(src_fd, &map_offset, src_size, extents, COPYFILE_EXTENT_BATCH)) {
+		for (ssize_t i = 0; i < nextents; i++) {
+			current_src_offset = extents[i].ce_offset;
+			extent_end = current_src_offset + extents[i].ce_length;
+
+			if (use_punchhole && current_src_offset > hole_start &&
+				copyfile_punch_hole(dst_fd, hole_start - src_start + dst_start,
+									current_src_offset - hole_start, output_blk_size) == -1) {
+				// Hole punching is best effort; keep copying data.
+				use_punchhole = false;
+			}
 
-		while (left > 0) {
-			nwritten = write(dst_fd, ptr, left);
-			switch (nwritten) {
-				case 0:
-					if (++loop > 5) {
-						copyfile_warn("writing to output %d times resulted in 0 bytes written", loop);
-						errno = EAGAIN;
+			while (current_src_offset < extent_end) {
+				size_t left;
+				char *ptr = bp;
+				int loop = 0;
+
+				nread = pread(src_fd, bp, (size_t) MIN((off_t) xfersize, extent_end - current_src_offset), current_src_offset);
+				if (nread < 0) {
+					copyfile_warn("error %d reading from %s", errno, s->src ? s->src : "(null src)");
+					goto error_exit;
+				} else if (nread == 0) {
+					// The source shrank underneath us.
+					break;
+				}
+
+				// Any hole we skipped over reads as zeros.
+				copyfile_checksum_update(s, NULL, current_src_offset - checksummed_offset);
+				copyfile_checksum_update(s, bp, nread);
+				checksummed_offset = current_src_offset + nread;
+
+				copyfile_throttle(s, 0, 1);
+				left = nread;
+				dst_offset = dst_start + current_src_offset - src_start;
+				while (left > 0) {
+					ssize_t nwritten;
+					bool zeros = false;
+					size_t len = left;
+
+					if (skip_zeros)
+						len = copyfile_zero_span(ptr, left, dst_offset, output_blk_size, &zeros);
+					if (zeros) {
+						// Whole blocks of zeros within a data section (such as space the source
+						// preallocated but never wrote) already read as zeros in our freshly
+						// truncated destination, so leave them as holes rather than writing them out.
+						nwritten = (ssize_t) len;
+					} else {
+						copyfile_throttle(s, len, 1);
+						nwritten = pwrite(dst_fd, ptr, len, dst_offset);
+					}
+					switch (nwritten) {
+						case 0:
+							if (++loop > 5) {
+								copyfile_warn("writing to output %d times resulted in 0 bytes written", loop);
+								errno = EAGAIN;
+								goto error_exit;
+							}
+							break;
+						case -1:
+							copyfile_warn("writing to output file failed");
+							if (status) {
+								int rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_ERR, s, s->src, s->dst, s->ctx);
+								if (rv == COPYFILE_SKIP) {	// Skip the data copy
+									errno = 0;
+									goto exit;
+								} else if (rv == COPYFILE_CONTINUE) {	// Retry the write
+									errno = 0;
+									continue;
+								}
+							}
+							// If we get here, we either have no callback or it didn't tell us to continue.
+							goto error_exit;
+							break;
+						default:
+							left -= nwritten;
+							ptr += nwritten;
+							dst_offset += nwritten;
+							loop = 0;
+							break;
+					}
+					s->totalCopied += nwritten;
+					if (copyfile_data_progress(s, false) == COPYFILE_QUIT) {
+						errno = ECANCELED;
 						goto error_exit;
 					}
+				}
+				current_src_offset += nread;
+			}
+			hole_start = extent_end;
+		}
+	}
+	if (nextents < 0) {
+		copyfile_warn("unable to map data sections of %s", s->src ? s->src : "(null src)");
+		goto error_exit;
+	}
+
+	// Punch whatever hole follows the last data section.
+	if (use_punchhole && src_size > hole_start) {
+		(void) copyfile_punch_hole(dst_fd, hole_start - src_start + dst_start,
+								   src_size - hole_start, output_blk_size);
+	}
+
+copied:
+	// Leave both file descriptors just past what we copied, as a full copy would.
+	if (lseek(src_fd, src_size, SEEK_SET) == -1 ||
+		lseek(dst_fd, dst_start + src_size - src_start, SEEK_SET) == -1) {
+		goto error_exit;
+	}
+
+	// Since we don't know in advance how many bytes we're copying, we advance this number
+	// as we copy, but to match copyfile_data() we set it here to the amount of bytes that would
+	// have been transferred in a full copy.
+	s->totalCopied = src_size - src_start;
+	copyfile_checksum_update(s, NULL, src_size - checksummed_offset);
+	if (copyfile_data_progress(s, true) == COPYFILE_QUIT) {
+		errno = ECANCELED;
+		goto error_exit;
+	}
+
+exit:
+	if (bp) {
+		free(bp);
+		bp = NULL;
+	}
+
+	return rc;
+
+error_exit:
+	s->err = errno;
+	rc = -1;
+	goto exit;
+}
+
+/*
+ * Bounds on the I/O size that COPYFILE_STATE_ADAPTIVE_BSIZE settles on,
+ * the least data each candidate size is timed over, the smallest file
+ * worth tuning with, and how many device pairs we remember.
+ */
+#define COPYFILE_TUNE_MIN_BSIZE		(64 * 1024)
+#define COPYFILE_TUNE_MAX_BSIZE		(16 * 1024 * 1024)
+#define COPYFILE_TUNE_PROBE_SIZE	(8 * 1024 * 1024)
+#define COPYFILE_TUNE_MIN_FILE_SIZE	(128 * 1024 * 1024)
+#define COPYFILE_TUNE_CACHE_SIZE	16
+
+/*
+ * The I/O sizes adaptive copies have settled on, by the
+ * pair of devices they copied between, for the life of the process.
+ */
+static struct {
+	dev_t	src_dev;
+	dev_t	dst_dev;
+	size_t	bsize;
+} copyfile_tuned_bsizes[COPYFILE_TUNE_CACHE_SIZE];
+static uint32_t copyfile_tuned_bsizes_next;
+static pthread_mutex_t copyfile_tuned_bsizes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t copyfile_tuned_bsize_lookup(dev_t src_dev, dev_t dst_dev)
+{
+	size_t bsize = 0;
+
+	pthread_mutex_lock(&copyfile_tuned_bsizes_lock);
+	for (uint32_t i = 0; i < COPYFILE_TUNE_CACHE_SIZE; i++) {
+		if (copyfile_tuned_bsizes[i].bsize != 0 &&
+			copyfile_tuned_bsizes[i].src_dev == src_dev &&
+			copyfile_tuned_bsizes[i].dst_dev == dst_dev) {
+			bsize = copyfile_tuned_bsizes[i].bsize;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&copyfile_tuned_bsizes_lock);
+
+	return bsize;
+}
+
+static void copyfile_tuned_bsize_save(dev_t src_dev, dev_t dst_dev, size_t bsize)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&copyfile_tuned_bsizes_lock);
+	for (i = 0; i < COPYFILE_TUNE_CACHE_SIZE; i++) {
+		if (copyfile_tuned_bsizes[i].bsize != 0 &&
+			copyfile_tuned_bsizes[i].src_dev == src_dev &&
+			copyfile_tuned_bsizes[i].dst_dev == dst_dev) {
+			break;
+		}
+	}
+	if (i == COPYFILE_TUNE_CACHE_SIZE) {
+		// Replace the oldest entry.
+		i = copyfile_tuned_bsizes_next;
+		copyfile_tuned_bsizes_next = (i + 1) % COPYFILE_TUNE_CACHE_SIZE;
+	}
+	copyfile_tuned_bsizes[i].src_dev = src_dev;
+	copyfile_tuned_bsizes[i].dst_dev = dst_dev;
+	copyfile_tuned_bsizes[i].bsize = bsize;
+	pthread_mutex_unlock(&copyfile_tuned_bsizes_lock);
+}
+
+/*
+ * Calculate the input (source file) and output (destination) block sizes,
+ * using any provided by the state if valid.
+ * Our output block size can be no greater than our input block size,
+ * and is also limited by the source file size.
+ */
+static void copyfile_get_bsizes(copyfile_state_t s, bool copy_rsrc, copyfile_bsizes_t *bsizes)
+{
+	size_t iBlocksize = 0, iMinblocksize = 0;
+	size_t oBlocksize = 0, oMinblocksize = 0; // If 0, we don't support sparse copying.
+	const size_t blocksize_limit = 1 << 30; // 1 GiB
+
+	struct stat *sb;
+	int src_fd = -1, dst_fd = -1;
+	struct statfs sfs;
+
+	// Determine the file descriptors / stat buffers to look at
+	// (it is the caller's responsibility to make sure these are valid).
+	src_fd = copy_rsrc ? s->src_rsrc_fd : s->src_fd;
+	dst_fd = copy_rsrc ? s->dst_rsrc_fd : s->dst_fd;
+	sb = copy_rsrc ? s->rsrc_sb : &s->sb;
+
+	// Get default and fall-back values for the input blocksize.
+	if (fstatfs(src_fd, &sfs) == -1) {
+		iBlocksize = sb->st_blksize;
+	} else {
+		iBlocksize = sfs.f_iosize;
+		iMinblocksize = sfs.f_bsize;
+	}
+
+	// Get default and fall-back values for the output blocksize.
+	if (fstatfs(dst_fd, &sfs) == -1) {
+		oBlocksize = iBlocksize;
+	} else {
+		oBlocksize = (sfs.f_iosize == 0) ? iBlocksize : MIN((size_t) sfs.f_iosize, iBlocksize);
+		oMinblocksize = sfs.f_bsize;
+	}
+
+	// If the user has provided a valid source blocksize, use it instead.
+	if (s->src_bsize >= iMinblocksize) {
+		iBlocksize = s->src_bsize;
+	}
+
+	// If the user has provided a valid destination blocksize, use it instead,
+	// unless it is larger than the source blocksize.
+	if (s->dst_bsize >= oMinblocksize && s->dst_bsize <= iBlocksize) {
+		oBlocksize = s->dst_bsize;
+	}
+
+	// Only I/Os that are multiples of the device block size bypass the buffer cache
+	// entirely, so if we have been asked to, make sure any user-provided sizes are.
+	if ((s->internal_flags & cfNoCacheData) && iMinblocksize > 0 && oMinblocksize > 0) {
+		iBlocksize = roundup(iBlocksize, iMinblocksize);
+		oBlocksize = MIN(roundup(oBlocksize, oMinblocksize), iBlocksize);
+	}
+
+	// If we are tuning our I/O size (and the user has not provided one),
+	// use what we settled on for this pair of devices before, if anything.
+	if (!copy_rsrc && (s->internal_flags & cfAdaptiveBsize) && s->src_bsize == 0 && s->dst_bsize == 0) {
+		struct stat dst_sb;
+
+		s->tuned_bsize = 0;
+		if (fstat(dst_fd, &dst_sb) == 0) {
+			s->tuned_bsize = (uint32_t) copyfile_tuned_bsize_lookup(sb->st_dev, dst_sb.st_dev);
+		}
+		if (s->tuned_bsize != 0) {
+			iBlocksize = oBlocksize = s->tuned_bsize;
+		}
+	}
+
+	// 6453525 and 34848916 require us to limit our blocksize to resonable values.
+	if ((size_t) sb->st_size < iBlocksize && iMinblocksize > 0) {
+		copyfile_debug(3, "rounding up block size from fsize: %lld to multiple of %zu\n",
+			s->sb.st_size, iMinblocksize);
+		iBlocksize = roundup((size_t) sb->st_size, iMinblocksize);
+		oBlocksize = MIN(oBlocksize, iBlocksize);
+	}
+
+	if (iBlocksize > blocksize_limit) {
+		iBlocksize = blocksize_limit;
+		oBlocksize = MIN(oBlocksize, iBlocksize);
+	}
+
+	// Save our decided values.
+	bsizes->cb_src_bsize = iBlocksize;
+	bsizes->cb_src_minbsize = iMinblocksize;
+	bsizes->cb_dst_bsize = oBlocksize;
+	bsizes->cb_dst_minbsize = oMinblocksize;
+
+	// Make sure any system calls we made here that failed
+	// don't set any user-visible error.
+	errno = 0;
+}
+
+/*
+ * The most buffers (and so asynchronous I/Os) that copyfile_data_aio()
+ * will keep in flight at once; this is the default per-process AIO limit.
+ */
+#define COPYFILE_AIO_MAX_QDEPTH	16
+
+typedef struct copyfile_aio_slot {
+	struct aiocb	cas_cb;
+	char		*cas_buf;
+	off_t		cas_offset;	// source-relative offset of this buffer's data
+	size_t		cas_length;	// bytes of valid data in this buffer
+	size_t		cas_written;	// bytes of this buffer written so far
+	int		cas_loop;	// consecutive zero-length writes
+	bool		cas_busy;	// an I/O is in flight on this slot
+	bool		cas_writing;	// the I/O in flight is a write
+} copyfile_aio_slot_t;
+
+static int copyfile_aio_submit(copyfile_aio_slot_t *slot, int fd, off_t offset,
+	char *buf, size_t length, bool write)
+{
+	memset(&slot->cas_cb, 0, sizeof(slot->cas_cb));
+	slot->cas_cb.aio_fildes = fd;
+	slot->cas_cb.aio_offset = offset;
+	slot->cas_cb.aio_buf = buf;
+	slot->cas_cb.aio_nbytes = length;
+	slot->cas_cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+
+	if ((write ? aio_write : aio_read)(&slot->cas_cb) == -1)
+		return -1;
+
+	slot->cas_busy = true;
+	slot->cas_writing = write;
+	return 0;
+}
+
+/*
+ * Cancel (or wait for) any asynchronous I/O still in flight,
+ * so that our buffers can be released.
+ */
+static void copyfile_aio_drain(copyfile_aio_slot_t *slots, uint32_t nslots)
+{
+	errno_t _errsv = errno;
+
+	for (uint32_t i = 0; i < nslots; i++) {
+		const struct aiocb *cbp = &slots[i].cas_cb;
+
+		if (!slots[i].cas_busy)
+			continue;
+
+		(void)aio_cancel(slots[i].cas_cb.aio_fildes, &slots[i].cas_cb);
+		while (aio_error(cbp) == EINPROGRESS)
+			(void)aio_suspend(&cbp, 1, NULL);
+		(void)aio_return(&slots[i].cas_cb);
+		slots[i].cas_busy = false;
+	}
+
+	errno = _errsv;
+}
+
+/*
+ * Copy the data fork using POSIX asynchronous I/O, keeping up to
+ * s->data_qdepth reads and writes in flight at once (rather than
+ * waiting for each read() to finish before its write() is started).
+ * Every buffer is iosize bytes; reads are issued at increasing offsets
+ * from the current source offset, and each completed read is written
+ * to the same relative offset from the current destination offset.
+ * Progress and error callbacks follow copyfile_data().
+ * Returns 0 on success (with *total_copied set and both file offsets
+ * advanced past the copied data), -1 on error, or ENOTSUP if
+ * asynchronous I/O could not be started, in which case the caller should
+ * fall back to a synchronous copy. If the callback asked us to skip the
+ * copy, returns 0 with *skipped set.
+ */
+static int copyfile_data_aio(copyfile_state_t s, int src_fd, int dst_fd, size_t iosize,
+	off_t *total_copied, bool *skipped)
+{
+	copyfile_callback_t status = s->statuscb;
+	const uint32_t qdepth = MIN(s->data_qdepth, COPYFILE_AIO_MAX_QDEPTH);
+	copyfile_aio_slot_t *slots = NULL;
+	const struct aiocb **list = NULL;
+	char *bufs = NULL;
+	off_t src_start, dst_start, expected_size;
+	off_t next_offset = 0, eof_offset = OFF_MAX;
+	uint32_t i, inflight = 0;
+	bool started = false;
+	int ret = 0;
+
+	*total_copied = 0;
+	*skipped = false;
+
+	src_start = lseek(src_fd, 0, SEEK_CUR);
+	dst_start = lseek(dst_fd, 0, SEEK_CUR);
+	if (src_start < 0 || dst_start < 0 || iosize == 0) {
+		errno = 0;
+		return ENOTSUP;
+	}
+	expected_size = s->sb.st_size - src_start;
+
+	slots = calloc(qdepth, sizeof(*slots));
+	list = calloc(qdepth, sizeof(*list));
+	bufs = copyfile_data_buffer_alloc(qdepth * iosize);
+	if (slots == NULL || list == NULL || bufs == NULL) {
+		// We can still perform a synchronous copy with a smaller buffer.
+		copyfile_debug(3, "cannot allocate %u buffers of %zu bytes", qdepth, iosize);
+		errno = 0;
+		ret = ENOTSUP;
+		goto exit;
+	}
+	for (i = 0; i < qdepth; i++) {
+		slots[i].cas_buf = bufs + (i * iosize);
+	}
+
+	copyfile_debug(3, "copying with %u asynchronous buffers of %zu bytes", qdepth, iosize);
+
+	for (;;) {
+		// Start reading into any idle buffers, until we reach the end of the source.
+		// Past the size we expect the source to be, only read one buffer at a time
+		// (in case the file grew) until a short read tells us where the end is.
+		for (i = 0; i < qdepth && next_offset < eof_offset; i++) {
+			if (slots[i].cas_busy)
+				continue;
+			if (next_offset >= expected_size && inflight > 0)
+				break;
+
+			if (copyfile_aio_submit(&slots[i], src_fd, src_start + next_offset,
+					slots[i].cas_buf, iosize, false) == -1) {
+				if (errno == EAGAIN && inflight > 0) {
+					// We've hit the system's AIO limit; wait for some to finish.
+					break;
+				} else if (!started) {
+					copyfile_debug(3, "aio_read failed (%d), falling back to read()", errno);
+					errno = 0;
+					ret = ENOTSUP;
+					goto exit;
+				}
+				copyfile_warn("aio_read on %s failed", s->src ? s->src : "(null src)");
+				ret = -1;
+				goto exit;
+			}
+			slots[i].cas_offset = next_offset;
+			next_offset += iosize;
+			list[i] = &slots[i].cas_cb;
+			inflight++;
+			started = true;
+		}
+
+		if (inflight == 0)
+			break;
+
+		if (aio_suspend(list, (int) qdepth, NULL) == -1 && errno != EINTR) {
+			copyfile_warn("aio_suspend failed");
+			ret = -1;
+			goto exit;
+		}
+
+		for (i = 0; i < qdepth; i++) {
+			copyfile_aio_slot_t *slot = &slots[i];
+			int error;
+			ssize_t nio;
+
+			if (!slot->cas_busy || (error = aio_error(&slot->cas_cb)) == EINPROGRESS)
+				continue;
+
+			nio = aio_return(&slot->cas_cb);
+			slot->cas_busy = false;
+			list[i] = NULL;
+			inflight--;
+
+			if (!slot->cas_writing) {
+				if (nio < 0) {
+					errno = error;
+					copyfile_warn("reading from %s", s->src ? s->src : "(null src)");
+					ret = -1;
+					goto exit;
+				}
+
+				// A short read marks the end of the source; anything read past it is stale.
+				if ((size_t) nio < iosize) {
+					eof_offset = MIN(eof_offset, slot->cas_offset + nio);
+				}
+				if (slot->cas_offset >= eof_offset)
+					continue;
+
+				slot->cas_length = (size_t) MIN((off_t) nio, eof_offset - slot->cas_offset);
+				slot->cas_written = 0;
+				slot->cas_loop = 0;
+			} else if (nio < 0) {
+				errno = error;
+				copyfile_warn("writing to output file got error");
+				if (status) {
+					int rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_ERR, s, s->src, s->dst, s->ctx);
+					if (rv == COPYFILE_SKIP) {	// Skip the data copy
+						*skipped = true;
+						ret = 0;
+						goto exit;
+					} else if (rv == COPYFILE_CONTINUE) {	// Retry the write
+						errno = 0;
+						goto submit_write;
+					}
+				}
+				ret = -1;
+				goto exit;
+			} else if (nio == 0) {
+				if (++slot->cas_loop > 5) {
+					copyfile_warn("writing to output %d times resulted in 0 bytes written", slot->cas_loop);
+					errno = EAGAIN;
+					ret = -1;
+					goto exit;
+				}
+			} else {
+				slot->cas_written += nio;
+				slot->cas_loop = 0;
+				*total_copied += nio;
+				s->totalCopied += nio;
+				if (copyfile_data_progress(s, false) == COPYFILE_QUIT) {
+					errno = ECANCELED;
+					ret = -1;
+					goto exit;
+				}
+			}
+
+			if (slot->cas_written == slot->cas_length)
+				continue;	// This buffer is free to read into again.
+
+		submit_write:
+			// Write (the remainder of) this buffer.
+			if (copyfile_aio_submit(slot, dst_fd,
+					dst_start + slot->cas_offset + (off_t) slot->cas_written,
+					slot->cas_buf + slot->cas_written,
+					slot->cas_length - slot->cas_written, true) == -1) {
+				copyfile_warn("aio_write on %s failed", s->dst ? s->dst : "(null dst)");
+				ret = -1;
+				goto exit;
+			}
+			list[i] = &slot->cas_cb;
+			inflight++;
+		}
+	}
+
+	// Leave the file offsets where read() and write() would have.
+	if (lseek(src_fd, src_start + *total_copied, SEEK_SET) == -1 ||
+		lseek(dst_fd, dst_start + *total_copied, SEEK_SET) == -1) {
+		ret = -1;
+	}
+
+exit:
+	if (slots) {
+		copyfile_aio_drain(slots, qdepth);
+		free(slots);
+	}
+	free(list);
+	free(bufs);
+	return ret;
+}
+
+/*
+ * The most worker threads copyfile_data_parallel() will use,
+ * and the largest range of a file any one of them copies at a time.
+ */
+#define COPYFILE_MAX_THREADS		32
+#define COPYFILE_PARALLEL_MAX_CHUNK	(64 * 1024 * 1024)
+
+/*
+ * Shared state for a parallel data copy.
+ * Workers only report what they have done here; all callbacks
+ * are made from the thread that called copyfile_data().
+ */
+typedef struct copyfile_parallel_ctx {
+	pthread_mutex_t	cpc_lock;
+	pthread_cond_t	cpc_cond;
+	copyfile_state_t cpc_state;
+	int		cpc_src_fd;
+	int		cpc_dst_fd;
+	off_t		cpc_src_start;
+	off_t		cpc_dst_start;
+	off_t		cpc_length;	// bytes we expect to copy
+	off_t		cpc_chunk_size;
+	size_t		cpc_iosize;
+	size_t		cpc_hole_size;	// if copying sparsely, the destination's block size
+	bool		cpc_skip_zeros;	// if copying sparsely, leave blocks of zeros unwritten
+	_Atomic(off_t)	cpc_next_chunk;	// next (relative) offset to hand out
+	_Atomic(bool)	cpc_cancel;	// workers should stop (set with cpc_lock held)
+	// The fields below are protected by cpc_lock.
+	off_t		cpc_copied;	// bytes written by all workers
+	off_t		cpc_src_eof;	// end of the source (an offset in it), if it shrank
+	uint32_t	cpc_active;	// workers still running
+	int		cpc_error;	// first unrecoverable error
+	bool		cpc_skipped;	// the callback asked us to skip the copy
+	bool		cpc_err_pending; // a worker is waiting for a COPYFILE_ERR verdict
+	int		cpc_err_errno;
+	int		cpc_err_verdict; // -1 until the callback has been made
+} copyfile_parallel_ctx_t;
+
+/*
+ * Called by a worker (with cpc_lock held) when a write fails:
+ * ask the copying thread to consult the callback, and wait for its answer.
+ * Returns the callback's verdict, or COPYFILE_QUIT if there is no callback.
+ */
+static int copyfile_parallel_write_error(copyfile_parallel_ctx_t *ctx, int error)
+{
+	int verdict;
+
+	if (ctx->cpc_state->statuscb == NULL)
+		return COPYFILE_QUIT;
+
+	while (ctx->cpc_err_pending && !atomic_load_explicit(&ctx->cpc_cancel, memory_order_relaxed))
+		pthread_cond_wait(&ctx->cpc_cond, &ctx->cpc_lock);
+	if (atomic_load_explicit(&ctx->cpc_cancel, memory_order_relaxed))
+		return COPYFILE_QUIT;
+
+	ctx->cpc_err_pending = true;
+	ctx->cpc_err_errno = error;
+	ctx->cpc_err_verdict = -1;
+	pthread_cond_broadcast(&ctx->cpc_cond);
+	while (ctx->cpc_err_verdict == -1)
+		pthread_cond_wait(&ctx->cpc_cond, &ctx->cpc_lock);
+
+	verdict = ctx->cpc_err_verdict;
+	ctx->cpc_err_pending = false;
+	pthread_cond_broadcast(&ctx->cpc_cond);
+	return verdict;
+}
+
+/*
+ * Copy [offset, end) of the source (relative to where the copy starts)
+ * through bp with pread()/pwrite(), iosize bytes at a time.
+ * If asked to (cpc_skip_zeros), whole blocks of zeros are left unwritten.
+ * Returns false if the worker should stop.
+ */
+static bool copyfile_parallel_copy_range(copyfile_parallel_ctx_t *ctx, char *bp, off_t offset, off_t end)
+{
+	ssize_t nread, nwritten;
+	int loop;
+
+	for (; offset < end; offset += nread) {
+		size_t left;
+		char *ptr = bp;
+
+		if (atomic_load_explicit(&ctx->cpc_cancel, memory_order_relaxed))
+			return false;
+
+		nread = pread(ctx->cpc_src_fd, bp, (size_t) MIN((off_t) ctx->cpc_iosize, end - offset),
+			ctx->cpc_src_start + offset);
+		if (nread <= 0) {
+			pthread_mutex_lock(&ctx->cpc_lock);
+			if (nread < 0) {
+				// Reads are not retried, matching copyfile_data().
+				if (ctx->cpc_error == 0)
+					ctx->cpc_error = errno;
+				atomic_store_explicit(&ctx->cpc_cancel, true, memory_order_relaxed);
+			} else {
+				// The source shrank underneath us.
+				ctx->cpc_src_eof = MIN(ctx->cpc_src_eof, ctx->cpc_src_start + offset);
+			}
+			pthread_cond_broadcast(&ctx->cpc_cond);
+			pthread_mutex_unlock(&ctx->cpc_lock);
+			return false;
+		}
+
+		left = (size_t) nread;
+		loop = 0;
+		while (left > 0) {
+			off_t dst_offset = ctx->cpc_dst_start + offset + (ptr - bp);
+			size_t len = left;
+			bool zeros = false;
+
+			if (ctx->cpc_skip_zeros)
+				len = copyfile_zero_span(ptr, left, dst_offset, ctx->cpc_hole_size, &zeros);
+			nwritten = zeros ? (ssize_t) len : pwrite(ctx->cpc_dst_fd, ptr, len, dst_offset);
+			if (nwritten > 0) {
+				left -= nwritten;
+				ptr += nwritten;
+				loop = 0;
+
+				pthread_mutex_lock(&ctx->cpc_lock);
+				ctx->cpc_copied += nwritten;
+				pthread_cond_broadcast(&ctx->cpc_cond);
+				pthread_mutex_unlock(&ctx->cpc_lock);
+				continue;
+			}
+
+			pthread_mutex_lock(&ctx->cpc_lock);
+			if (nwritten == 0 && ++loop <= 5) {
+				pthread_mutex_unlock(&ctx->cpc_lock);
+				continue;
+			} else if (nwritten == 0) {
+				if (ctx->cpc_error == 0)
+					ctx->cpc_error = EAGAIN;
+				atomic_store_explicit(&ctx->cpc_cancel, true, memory_order_relaxed);
+			} else {
+				int error = errno;
+
+				switch (copyfile_parallel_write_error(ctx, error)) {
+					case COPYFILE_CONTINUE:	// Retry the write
+						pthread_mutex_unlock(&ctx->cpc_lock);
+						continue;
+					case COPYFILE_SKIP:	// Skip the data copy
+						ctx->cpc_skipped = true;
+						break;
+					default:
+						if (ctx->cpc_error == 0)
+							ctx->cpc_error = error;
+						break;
+				}
+				atomic_store_explicit(&ctx->cpc_cancel, true, memory_order_relaxed);
+			}
+			pthread_cond_broadcast(&ctx->cpc_cond);
+			pthread_mutex_unlock(&ctx->cpc_lock);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Leave [offset, end) of a sparse copy as a hole, punching whatever
+ * whole destination blocks it covers (until punching fails once),
+ * and count it as copied.
+ */
+static void copyfile_parallel_hole(copyfile_parallel_ctx_t *ctx, off_t offset, off_t end, bool *punch)
+{
+	if (*punch && copyfile_punch_hole(ctx->cpc_dst_fd, ctx->cpc_dst_start + offset,
+									  end - offset, ctx->cpc_hole_size) == -1) {
+		*punch = false;
+	}
+
+	pthread_mutex_lock(&ctx->cpc_lock);
+	ctx->cpc_copied += end - offset;
+	pthread_cond_broadcast(&ctx->cpc_cond);
+	pthread_mutex_unlock(&ctx->cpc_lock);
+}
+
+/*
+ * Copy [chunk, end) of a sparse source: map its data sections,
+ * copy only those, and leave holes between them.
+ * Workers probe the source concurrently; this is safe, as SEEK_DATA and
+ * SEEK_HOLE return the offset they find rather than the descriptor's
+ * (which copyfile_data_parallel_copy() sets once all of them are done).
+ * Returns false if the worker should stop.
+ */
+static bool copyfile_parallel_copy_sparse(copyfile_parallel_ctx_t *ctx, char *bp, off_t chunk, off_t end)
+{
+	struct copyfile_extent extents[COPYFILE_EXTENT_BATCH];
+	off_t map_offset = ctx->cpc_src_start + chunk, hole_start = chunk;
+	ssize_t nextents;
+	bool punch = true;
+
+	while ((nextents = copyfile_extent_map(ctx->cpc_src_fd, &map_offset, ctx->cpc_src_start + end,
+										   extents, COPYFILE_EXTENT_BATCH)) > 0) {
+		for (ssize_t i = 0; i < nextents; i++) {
+			off_t data = extents[i].ce_offset - ctx->cpc_src_start;
+
+			if (data > hole_start)
+				copyfile_parallel_hole(ctx, hole_start, data, &punch);
+			if (!copyfile_parallel_copy_range(ctx, bp, data, data + extents[i].ce_length))
+				return false;
+			hole_start = data + extents[i].ce_length;
+		}
+	}
+	if (nextents < 0) {
+		pthread_mutex_lock(&ctx->cpc_lock);
+		if (ctx->cpc_error == 0)
+			ctx->cpc_error = errno;
+		atomic_store_explicit(&ctx->cpc_cancel, true, memory_order_relaxed);
+		pthread_cond_broadcast(&ctx->cpc_cond);
+		pthread_mutex_unlock(&ctx->cpc_lock);
+		return false;
+	}
+	if (end > hole_start)
+		copyfile_parallel_hole(ctx, hole_start, end, &punch);
+
+	return true;
+}
+
+/*
+ * A single worker: repeatedly claim the next range of the file and copy it.
+ */
+static void copyfile_parallel_worker(copyfile_parallel_ctx_t *ctx, char *bp)
+{
+	off_t chunk, end;
+	bool more = true;
+
+	while (more && (chunk = atomic_fetch_add(&ctx->cpc_next_chunk, ctx->cpc_chunk_size)) < ctx->cpc_length) {
+		end = MIN(chunk + ctx->cpc_chunk_size, ctx->cpc_length);
+
+		if (ctx->cpc_hole_size > 0)
+			more = copyfile_parallel_copy_sparse(ctx, bp, chunk, end);
+		else
+			more = copyfile_parallel_copy_range(ctx, bp, chunk, end);
+	}
+
+	pthread_mutex_lock(&ctx->cpc_lock);
+	ctx->cpc_active--;
+	pthread_cond_broadcast(&ctx->cpc_cond);
+	pthread_mutex_unlock(&ctx->cpc_lock);
+}
+
+/*
+ * Copy the data fork from src_start on by splitting it into ranges that are
+ * copied concurrently by up to s->data_threads workers with pread()/pwrite().
+ * This allows striped, RAID and network-backed volumes, where a single
+ * sequential stream cannot saturate the device, to be copied faster.
+ * The destination is sized once up front (after the caller has
+ * preallocated it), and ranges are aligned to iosize.
+ * If hole_size is not 0, each worker copies only the data sections of its
+ * ranges, punching holes (of whole hole_size blocks) in the destination
+ * for the rest, which must already read as zeros;
+ * if skip_zeros is also set, whole blocks of zeros within the data sections
+ * are left unwritten as well.
+ * The calling thread makes all of the status callbacks: progress is
+ * aggregated into s->totalCopied and reported as workers make it, and
+ * a write error is reported (with the failing worker waiting for the
+ * verdict, so that COPYFILE_CONTINUE retries that write).
+ * Returns the same values as copyfile_data_aio().
+ */
+static int copyfile_data_parallel_copy(copyfile_state_t s, int src_fd, int dst_fd, off_t src_start, off_t dst_start,
+	size_t iosize, size_t hole_size, bool skip_zeros, off_t *total_copied, bool *skipped)
+{
+	copyfile_callback_t status = s->statuscb;
+	copyfile_parallel_ctx_t ctx = {0};
+	dispatch_group_t group = NULL;
+	char *bufs = NULL;
+	uint32_t nthreads = MIN(s->data_threads, COPYFILE_MAX_THREADS);
+	off_t reported = 0, base = s->totalCopied;
+	int ret = 0;
+
+	*total_copied = 0;
+	*skipped = false;
+
+	if (src_start < 0 || dst_start < 0 || iosize == 0 || src_start >= s->sb.st_size) {
+		errno = 0;
+		return ENOTSUP;
+	}
+
+	ctx.cpc_state = s;
+	ctx.cpc_src_fd = src_fd;
+	ctx.cpc_dst_fd = dst_fd;
+	ctx.cpc_src_start = src_start;
+	ctx.cpc_dst_start = dst_start;
+	ctx.cpc_length = s->sb.st_size - src_start;
+	ctx.cpc_iosize = iosize;
+	ctx.cpc_hole_size = hole_size;
+	ctx.cpc_skip_zeros = (hole_size > 0 && skip_zeros);
+	ctx.cpc_src_eof = s->sb.st_size;
+	ctx.cpc_err_verdict = -1;
+
+	// Give each worker a few ranges, so that they finish at around the same time.
+	ctx.cpc_chunk_size = roundup(howmany(ctx.cpc_length, (off_t) nthreads * 4), (off_t) iosize);
+	ctx.cpc_chunk_size = MIN(ctx.cpc_chunk_size, roundup(COPYFILE_PARALLEL_MAX_CHUNK, (off_t) iosize));
+	nthreads = (uint32_t) MIN((off_t) nthreads, howmany(ctx.cpc_length, ctx.cpc_chunk_size));
+	if (nthreads < 2) {
+		// Not worth the trouble.
+		errno = 0;
+		return ENOTSUP;
+	}
+
+	if ((bufs = copyfile_data_buffer_alloc(nthreads * iosize)) == NULL) {
+		copyfile_debug(3, "cannot allocate %u buffers of %zu bytes", nthreads, iosize);
+		errno = 0;
+		return ENOTSUP;
+	}
+
+	// Size the destination once, so that workers never extend it concurrently.
+	if (ftruncate(dst_fd, dst_start + ctx.cpc_length) == -1) {
+		copyfile_warn("could not set destination file size before copy");
+		free(bufs);
+		return -1;
+	}
+
+	copyfile_debug(3, "copying %lld bytes with %u threads in %lld byte ranges",
+		ctx.cpc_length, nthreads, ctx.cpc_chunk_size);
+
+	pthread_mutex_init(&ctx.cpc_lock, NULL);
+	pthread_cond_init(&ctx.cpc_cond, NULL);
+	atomic_init(&ctx.cpc_next_chunk, 0);
+	atomic_init(&ctx.cpc_cancel, false);
+	ctx.cpc_active = nthreads;
+
+	group = dispatch_group_create();
+	for (uint32_t i = 0; i < nthreads; i++) {
+		copyfile_parallel_ctx_t *ctxp = &ctx;
+		char *bp = bufs + (i * iosize);
+
+		dispatch_group_async(group, dispatch_get_global_queue(qos_class_self(), 0), ^{
+			copyfile_parallel_worker(ctxp, bp);
+		});
+	}
+
+	pthread_mutex_lock(&ctx.cpc_lock);
+	while (ctx.cpc_active > 0) {
+		if (ctx.cpc_err_pending && ctx.cpc_err_verdict == -1) {
+			int rv;
+
+			pthread_mutex_unlock(&ctx.cpc_lock);
+			errno = ctx.cpc_err_errno;
+			copyfile_warn("writing to output file got error");
+			rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_ERR, s, s->src, s->dst, s->ctx);
+			if (rv == COPYFILE_CONTINUE)
+				errno = 0;
+			pthread_mutex_lock(&ctx.cpc_lock);
+			ctx.cpc_err_verdict = rv;
+			pthread_cond_broadcast(&ctx.cpc_cond);
+		} else if (ctx.cpc_copied > reported && !atomic_load_explicit(&ctx.cpc_cancel, memory_order_relaxed)) {
+			reported = ctx.cpc_copied;
+			s->totalCopied = base + reported;
+			if (status) {
+				int rv;
+
+				pthread_mutex_unlock(&ctx.cpc_lock);
+				rv = copyfile_data_progress(s, false);
+				pthread_mutex_lock(&ctx.cpc_lock);
+				if (rv == COPYFILE_QUIT) {
+					if (ctx.cpc_error == 0)
+						ctx.cpc_error = ECANCELED;
+					atomic_store_explicit(&ctx.cpc_cancel, true, memory_order_relaxed);
+					pthread_cond_broadcast(&ctx.cpc_cond);
+				}
+			}
+		} else {
+			pthread_cond_wait(&ctx.cpc_cond, &ctx.cpc_lock);
+		}
+	}
+	pthread_mutex_unlock(&ctx.cpc_lock);
+
+	dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+	dispatch_release(group);
+	pthread_cond_destroy(&ctx.cpc_cond);
+	pthread_mutex_destroy(&ctx.cpc_lock);
+	free(bufs);
+
+	s->totalCopied = base + ctx.cpc_copied;
+	if (ctx.cpc_skipped) {
+		*skipped = true;
+		return 0;
+	} else if (ctx.cpc_error) {
+		errno = ctx.cpc_error;
+		return -1;
+	}
+
+	// Make sure our final callback reflects everything that was written.
+	if (status && ctx.cpc_copied > reported) {
+		if (copyfile_data_progress(s, false) == COPYFILE_QUIT) {
+			errno = ECANCELED;
+			return -1;
+		}
+	}
+
+	// Leave the file offsets where read() and write() would have.
+	*total_copied = MIN(ctx.cpc_copied, ctx.cpc_src_eof - src_start);
+	if (lseek(src_fd, src_start + *total_copied, SEEK_SET) == -1 ||
+		lseek(dst_fd, dst_start + *total_copied, SEEK_SET) == -1) {
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Copy the data fork from the current file offsets with copyfile_data_parallel_copy().
+ */
+static int copyfile_data_parallel(copyfile_state_t s, int src_fd, int dst_fd, size_t iosize,
+	off_t *total_copied, bool *skipped)
+{
+	return copyfile_data_parallel_copy(s, src_fd, dst_fd, lseek(src_fd, 0, SEEK_CUR), lseek(dst_fd, 0, SEEK_CUR),
+		iosize, 0, false, total_copied, skipped);
+}
+
+/*
+ * The number of blocksize-sized buffers a read-ahead pipeline
+ * may fill before the writer catches up.
+ */
+#define COPYFILE_PIPELINE_DEPTH	4
+
+/*
+ * A read-ahead pipeline: a reader thread read()s the source sequentially
+ * into a small ring of buffers, while the thread in copyfile_data()
+ * write()s them out in order. When the source and destination are on
+ * different devices this lets reads and writes overlap completely.
+ */
+typedef struct copyfile_pipeline {
+	pthread_mutex_t	cpp_lock;
+	pthread_cond_t	cpp_cond;
+	dispatch_group_t cpp_group;
+	int		cpp_src_fd;
+	size_t		cpp_bsize;
+	char		*cpp_bufs;
+	ssize_t		cpp_len[COPYFILE_PIPELINE_DEPTH];
+	uint32_t	cpp_head;	// next buffer to write
+	uint32_t	cpp_count;	// buffers filled and not yet written
+	bool		cpp_held;	// the writer holds the buffer at cpp_head
+	bool		cpp_done;	// the reader has finished
+	bool		cpp_cancel;	// the reader should stop
+	int		cpp_error;	// read() error, if any
+} copyfile_pipeline_t;
+
+static void copyfile_pipeline_reader(copyfile_pipeline_t *p)
+{
+	uint32_t tail = 0;
+	ssize_t nread;
+
+	pthread_mutex_lock(&p->cpp_lock);
+	for (;;) {
+		while (p->cpp_count == COPYFILE_PIPELINE_DEPTH && !p->cpp_cancel)
+			pthread_cond_wait(&p->cpp_cond, &p->cpp_lock);
+		if (p->cpp_cancel)
+			break;
+		pthread_mutex_unlock(&p->cpp_lock);
+
+		// This buffer is not visible to the writer until cpp_count is incremented.
+		nread = read(p->cpp_src_fd, p->cpp_bufs + (tail * p->cpp_bsize), p->cpp_bsize);
+
+		pthread_mutex_lock(&p->cpp_lock);
+		if (nread <= 0) {
+			p->cpp_error = (nread < 0) ? errno : 0;
+			break;
+		}
+		p->cpp_len[tail] = nread;
+		tail = (tail + 1) % COPYFILE_PIPELINE_DEPTH;
+		p->cpp_count++;
+		pthread_cond_broadcast(&p->cpp_cond);
+	}
+	p->cpp_done = true;
+	pthread_cond_broadcast(&p->cpp_cond);
+	pthread_mutex_unlock(&p->cpp_lock);
+}
+
+/*
+ * Start reading src_fd (from its current offset) in bsize-sized pieces
+ * on another thread. Returns NULL (having changed nothing) if we cannot.
+ */
+static copyfile_pipeline_t *copyfile_pipeline_start(int src_fd, size_t bsize)
+{
+	copyfile_pipeline_t *p;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return NULL;
+	if ((p->cpp_bufs = copyfile_data_buffer_alloc(COPYFILE_PIPELINE_DEPTH * bsize)) == NULL) {
+		free(p);
+		return NULL;
+	}
+	p->cpp_src_fd = src_fd;
+	p->cpp_bsize = bsize;
+	pthread_mutex_init(&p->cpp_lock, NULL);
+	pthread_cond_init(&p->cpp_cond, NULL);
+
+	p->cpp_group = dispatch_group_create();
+	dispatch_group_async(p->cpp_group, dispatch_get_global_queue(qos_class_self(), 0), ^{
+		copyfile_pipeline_reader(p);
+	});
+
+	return p;
+}
+
+/*
+ * Wait for the next buffer of source data, releasing the previous one.
+ * Returns its length (pointing *bufp at it), 0 at the end of the source,
+ * or -1 (with errno set) if the reader's read() failed.
+ */
+static ssize_t copyfile_pipeline_next(copyfile_pipeline_t *p, char **bufp)
+{
+	ssize_t len;
+
+	pthread_mutex_lock(&p->cpp_lock);
+	if (p->cpp_held) {
+		p->cpp_held = false;
+		p->cpp_head = (p->cpp_head + 1) % COPYFILE_PIPELINE_DEPTH;
+		p->cpp_count--;
+		pthread_cond_broadcast(&p->cpp_cond);
+	}
+	while (p->cpp_count == 0 && !p->cpp_done)
+		pthread_cond_wait(&p->cpp_cond, &p->cpp_lock);
+
+	if (p->cpp_count > 0) {
+		p->cpp_held = true;
+		*bufp = p->cpp_bufs + (p->cpp_head * p->cpp_bsize);
+		len = p->cpp_len[p->cpp_head];
+	} else if (p->cpp_error) {
+		errno = p->cpp_error;
+		len = -1;
+	} else {
+		len = 0;
+	}
+	pthread_mutex_unlock(&p->cpp_lock);
+
+	return len;
+}
+
+/*
+ * Stop the reader (if it is still running) and release the pipeline.
+ */
+static void copyfile_pipeline_stop(copyfile_pipeline_t *p)
+{
+	errno_t _errsv = errno;
+
+	pthread_mutex_lock(&p->cpp_lock);
+	p->cpp_cancel = true;
+	pthread_cond_broadcast(&p->cpp_cond);
+	pthread_mutex_unlock(&p->cpp_lock);
+
+	dispatch_group_wait(p->cpp_group, DISPATCH_TIME_FOREVER);
+	dispatch_release(p->cpp_group);
+	pthread_cond_destroy(&p->cpp_cond);
+	pthread_mutex_destroy(&p->cpp_lock);
+	free(p->cpp_bufs);
+	free(p);
+
+	errno = _errsv;
+}
+
+/*
+ * Get the next block of source data for copyfile_data():
+ * either from the read-ahead pipeline, if there is one,
+ * or by read()ing it into bp ourselves.
+ */
+static ssize_t copyfile_data_read(int src_fd, char *bp, size_t blen,
+	copyfile_pipeline_t *pipeline, char **bufp)
+{
+	if (pipeline)
+		return copyfile_pipeline_next(pipeline, bufp);
+
+	*bufp = bp;
+	return read(src_fd, bp, blen);
+}
+
+/*
+ * The largest part of the source copyfile_data_mmap() maps at once.
+ */
+#define COPYFILE_MMAP_WINDOW	(64 * 1024 * 1024)
+
+/*
+ * Copy a regular file's data by write()ing it straight out of
+ * successive read-only mappings of the source, from the current offsets.
+ * This saves allocating a buffer and copying each block into it.
+ *
+ * Touching a mapping beyond the end of a file faults, so the source's size
+ * is checked before each window is mapped; if it has shrunk since it was
+ * opened we stop here and return ENOTSUP (with *total_copied and both
+ * offsets reflecting what was copied) so that read() can do the rest.
+ * Otherwise, the return values are those of copyfile_data_aio().
+ */
+static int copyfile_data_mmap(copyfile_state_t s, int src_fd, int dst_fd, size_t iosize,
+	off_t *total_copied, bool *skipped)
+{
+	copyfile_callback_t status = s->statuscb;
+	const off_t pagesize = getpagesize();
+	off_t src_start, offset;
+	int ret = 0;
+
+	*total_copied = 0;
+	*skipped = false;
+
+	src_start = lseek(src_fd, 0, SEEK_CUR);
+	if (src_start < 0 || iosize == 0) {
+		errno = 0;
+		return ENOTSUP;
+	}
+
+	copyfile_debug(3, "copying from %d MB mappings of the source", COPYFILE_MMAP_WINDOW / (1024 * 1024));
+
+	for (offset = src_start;; offset = src_start + *total_copied) {
+		struct stat sb;
+		off_t map_start;
+		size_t map_len, left;
+		char *map, *ptr;
+		int loop = 0;
+
+		if (fstat(src_fd, &sb) == -1 || sb.st_size < s->sb.st_size) {
+			copyfile_debug(3, "source size changed, finishing the copy with read()");
+			ret = ENOTSUP;
+			break;
+		}
+		if (offset >= sb.st_size)
+			break;
+
+		map_start = offset & ~(pagesize - 1);
+		map_len = (size_t) MIN((off_t) COPYFILE_MMAP_WINDOW, sb.st_size - map_start);
+		map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, src_fd, map_start);
+		if (map == MAP_FAILED) {
+			copyfile_debug(3, "mmap failed (%d), finishing the copy with read()", errno);
+			ret = ENOTSUP;
+			break;
+		}
+		(void)madvise(map, map_len, MADV_SEQUENTIAL);
+		(void)madvise(map, map_len, MADV_WILLNEED);
+
+		ptr = map + (offset - map_start);
+		left = map_len - (size_t) (offset - map_start);
+		while (left > 0) {
+			ssize_t nwritten = write(dst_fd, ptr, MIN(left, iosize));
+
+			if (nwritten == 0) {
+				if (++loop > 5) {
+					copyfile_warn("writing to output %d times resulted in 0 bytes written", loop);
+					errno = EAGAIN;
+					ret = -1;
 					break;
-				case -1:
-					copyfile_warn("writing to output file failed");
-					if (status) {
-						int rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_ERR, s, s->src, s->dst, s->ctx);
-						if (rv == COPYFILE_SKIP) {	// Skip the data copy
-							errno = 0;
-							goto exit;
-						} else if (rv == COPYFILE_CONTINUE) {	// Retry the write
-							errno = 0;
-							continue;
-						}
+				}
+				continue;
+			} else if (nwritten == -1) {
+				copyfile_warn("writing to output file got error");
+				if (status) {
+					int rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_ERR, s, s->src, s->dst, s->ctx);
+					if (rv == COPYFILE_SKIP) {	// Skip the data copy
+						*skipped = true;
+						ret = 0;
+						break;
+					} else if (rv == COPYFILE_CONTINUE) {	// Retry the write
+						errno = 0;
+						continue;
 					}
-					// If we get here, we either have no callback or it didn't tell us to continue.
-					goto error_exit;
-					break;
-				default:
-					left -= nwritten;
-					ptr = ((char*)ptr) + nwritten;
-					loop = 0;
-					break;
+				}
+				ret = -1;
+				break;
 			}
+
+			copyfile_checksum_update(s, ptr, nwritten);
+			left -= nwritten;
+			ptr += nwritten;
+			loop = 0;
+			*total_copied += nwritten;
 			s->totalCopied += nwritten;
-			if (status) {
-				int rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_PROGRESS, s, s->src, s->dst, s->ctx);
-				if (rv == COPYFILE_QUIT) {
-					errno = ECANCELED;
-					goto error_exit;
-				}
+			if (copyfile_data_progress(s, false) == COPYFILE_QUIT) {
+				errno = ECANCELED;
+				ret = -1;
+				break;
 			}
 		}
-		current_src_offset += nread;
 
-		// Find the next area of src_fd to copy.
-		// Since data sections can be any length, we need see if current_src_offset points
-		// at a hole.
-		// If we get ENXIO, we're done copying (the last part of the file was a data section).
-		// If this is not a hole, we do not need to alter current_src_offset yet.
-		// If this is a hole, then we need to look for the next data section.
-		next_hole_offset = lseek(src_fd, current_src_offset, SEEK_HOLE);
-		if (next_hole_offset == -1) {
-			if (errno == ENXIO) {
-				break; // We're done copying data sections.
-			}
-			copyfile_warn("unable to find next hole in file during copy");
-			goto error_exit;
-		} else if (next_hole_offset != current_src_offset) {
-			// Keep copying this data section (we must rewind src_fd to current_src_offset).
-			if (lseek(src_fd, current_src_offset, SEEK_SET) == -1) {
-				goto error_exit;
+		(void)munmap(map, map_len);
+		if (ret != 0 || *skipped)
+			return ret;
+	}
+
+	// Leave the source offset where read() would have.
+	if (lseek(src_fd, src_start + *total_copied, SEEK_SET) == -1)
+		return -1;
+
+	if (ret == ENOTSUP)
+		errno = 0;
+	return ret;
+}
+
+/*
+ * Update an existing destination in place to match the source,
+ * from the current offsets: read both a block at a time and only
+ * write the blocks of the destination that differ (or that it lacks).
+ * COPYFILE_STATE_COPIED counts the bytes compared, and
+ * COPYFILE_STATE_DELTA_WRITTEN those that had to be written.
+ * Returns ENOTSUP (having done nothing) if we can't read the destination;
+ * otherwise, the return values are those of copyfile_data_aio().
+ */
+static int copyfile_data_delta(copyfile_state_t s, int src_fd, int dst_fd, size_t iosize,
+	off_t *total_copied, bool *skipped)
+{
+	copyfile_callback_t status = s->statuscb;
+	off_t src_start, dst_start, offset = 0;
+	char *src_buf = NULL, *dst_buf;
+	ssize_t nread, ndst;
+	int ret = 0;
+
+	*total_copied = 0;
+	*skipped = false;
+
+	src_start = lseek(src_fd, 0, SEEK_CUR);
+	dst_start = lseek(dst_fd, 0, SEEK_CUR);
+	if (src_start < 0 || dst_start < 0 || iosize == 0) {
+		errno = 0;
+		return ENOTSUP;
+	}
+
+	if ((src_buf = copyfile_data_buffer_alloc(2 * iosize)) == NULL) {
+		errno = 0;
+		return ENOTSUP;
+	}
+	dst_buf = src_buf + iosize;
+
+	copyfile_debug(3, "updating destination in place, %zu bytes at a time", iosize);
+
+	while ((nread = pread(src_fd, src_buf, iosize, src_start + offset)) > 0) {
+		size_t written = 0;
+		int loop = 0;
+
+		copyfile_throttle(s, 0, 2);
+		ndst = pread(dst_fd, dst_buf, (size_t) nread, dst_start + offset);
+		if (ndst < 0) {
+			if (offset == 0 && errno == EBADF) {
+				// The destination was not opened for reading.
+				copyfile_debug(3, "cannot read destination, copying all of the data");
+				errno = 0;
+				ret = ENOTSUP;
+				goto exit;
 			}
-			continue;
+			copyfile_warn("reading from %s", s->dst ? s->dst : "(null dst)");
+			ret = -1;
+			goto exit;
 		}
 
-		// If we get here, we need to find the next data section to copy.
-		next_src_offset = lseek(src_fd, current_src_offset, SEEK_DATA);
-		if (next_src_offset == -1) {
-			if (errno == ENXIO) {
-				// There are no more data sections in this file, so we're done with the copy.
-				break;
+		while (ndst != nread || memcmp(src_buf, dst_buf, (size_t) nread) != 0) {
+			ssize_t nwritten;
+
+			copyfile_throttle(s, (size_t) nread - written, 1);
+			nwritten = pwrite(dst_fd, src_buf + written, (size_t) nread - written,
+				dst_start + offset + (off_t) written);
+
+			if (nwritten == 0) {
+				if (++loop > 5) {
+					copyfile_warn("writing to output %d times resulted in 0 bytes written", loop);
+					errno = EAGAIN;
+					ret = -1;
+					goto exit;
+				}
+				continue;
+			} else if (nwritten == -1) {
+				copyfile_warn("writing to output file got error");
+				if (status) {
+					int rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_ERR, s, s->src, s->dst, s->ctx);
+					if (rv == COPYFILE_SKIP) {	// Skip the data copy
+						*skipped = true;
+						ret = 0;
+						goto exit;
+					} else if (rv == COPYFILE_CONTINUE) {	// Retry the write
+						errno = 0;
+						continue;
+					}
+				}
+				ret = -1;
+				goto exit;
 			}
 
-			copyfile_warn("unable to advance src to next data section");
-			goto error_exit;
+			loop = 0;
+			written += (size_t) nwritten;
+			s->delta_written += nwritten;
+			if (written == (size_t) nread)
+				break;
 		}
 
-		// Advance the dst_fd to match (taking into account where it started).
-		if (lseek(dst_fd, dst_start + (next_src_offset - src_start), SEEK_SET) == -1) {
-			copyfile_warn("unable to advance dst to next data section");
-			goto error_exit;
+		copyfile_checksum_update(s, src_buf, nread);
+		offset += nread;
+		*total_copied += nread;
+		s->totalCopied += nread;
+		if (copyfile_data_progress(s, false) == COPYFILE_QUIT) {
+			errno = ECANCELED;
+			ret = -1;
+			goto exit;
 		}
-
-		current_src_offset = next_src_offset;
 	}
 	if (nread < 0) {
-		copyfile_warn("error %d reading from %s", errno, s->src ? s->src : "(null src)");
-		goto error_exit;
+		copyfile_warn("reading from %s", s->src ? s->src : "(null src)");
+		ret = -1;
+		goto exit;
+	}
+
+	// Leave the file offsets where read() and write() would have.
+	if (lseek(src_fd, src_start + *total_copied, SEEK_SET) == -1 ||
+		lseek(dst_fd, dst_start + *total_copied, SEEK_SET) == -1) {
+		ret = -1;
 	}
 
-	// Punch holes where possible if needed.
-	if (use_punchhole) {
-		struct fpunchhole punchhole_args;
-		off_t hole_start = first_hole_offset, hole_end;
-		bool trailing_hole = true;
+exit:
+	free(src_buf);
+	return ret;
+}
+
+/*
+ * Copy the part of the source given by COPYFILE_STATE_RANGE_SRC_OFFSET and
+ * COPYFILE_STATE_RANGE_LENGTH (as much of it as there is) to the destination
+ * at COPYFILE_STATE_RANGE_DST_OFFSET, with pread() and pwrite(),
+ * leaving both file offsets where they were.  The destination is extended
+ * to the end of the range, if need be, but never truncated.
+ * If COPYFILE_DATA_SPARSE is set, holes in the range of the source
+ * are found with SEEK_DATA and SEEK_HOLE, and not written;
+ * if cfSkipZeros is set, nor are blocks of zeros (given hole_size).
+ * Either is only left unwritten past the destination's end, though:
+ * anywhere else, its old data would show through, so zeros are written.
+ * Returns 0 on success (with *skipped set if our callback asked us to skip),
+ * or -1 on error.
+ */
+static int copyfile_data_range(copyfile_state_t s, int src_fd, int dst_fd, size_t iosize,
+	size_t hole_size, bool *skipped)
+{
+	copyfile_callback_t status = s->statuscb;
+	const off_t src_start = s->range_src_offset, dst_start = s->range_dst_offset;
+	off_t src_end, src_dst_end, offset, data_end, src_saved = -1;
+	bool sparse = (s->flags & COPYFILE_DATA_SPARSE) != 0;
+	struct stat src_sb, dst_sb;
+	char *bp = NULL;
+	ssize_t nread = 0;
+	int ret = 0;
+
+	*skipped = false;
+
+	if (fstat(src_fd, &src_sb) == -1)
+		return -1;
+	src_end = (src_sb.st_size - src_start > s->range_length) ? src_start + s->range_length : src_sb.st_size;
+	if (src_end <= src_start)
+		return 0;
+
+	// Where in the source the copy reaches the destination's current end.
+	if (fstat(dst_fd, &dst_sb) == -1)
+		return -1;
+	src_dst_end = src_start + MAX(dst_sb.st_size - dst_start, 0);
+
+	if ((bp = copyfile_data_buffer_alloc(iosize)) == NULL)
+		return -1;
+
+	if (hole_size == 0)
+		copyfile_preallocate(s, dst_fd, dst_start + (src_end - src_start));
+
+	// SEEK_DATA and SEEK_HOLE move the source's offset; put it back when we're done.
+	if (sparse && (src_saved = lseek(src_fd, 0, SEEK_CUR)) == -1)
+		sparse = false;
+
+	copyfile_debug(3, "copying %lld bytes at offset %lld to offset %lld",
+		(long long) (src_end - src_start), (long long) src_start, (long long) dst_start);
+
+	for (offset = src_start; offset < src_end; ) {
+		data_end = src_end;
+		if (sparse) {
+			off_t data = lseek(src_fd, offset, SEEK_DATA);
+
+			if (data == -1 && errno == ENXIO) {
+				data = src_end;	// The rest of the range is a hole.
+			} else if (data == -1) {
+				copyfile_debug(3, "unable to find data in source, copying all of the range");
+				sparse = false;
+				data = offset;
+			}
+			data = MIN(data, src_end);
+			if (data > offset && offset < src_dst_end) {
+				// The destination has data here: copy this part of the hole
+				// (which reads as zeros), rather than let that show through.
+				data_end = MIN(data, src_dst_end);
+			} else {
+				copyfile_checksum_update(s, NULL, data - offset);
+				offset = data;
+				if (offset == src_end)
+					break;
+
+				if (sparse) {
+					off_t hole = lseek(src_fd, offset, SEEK_HOLE);
 
-		// First, reset the source and destination file descriptors.
-		if (lseek(src_fd, src_start, SEEK_SET) == -1 || lseek(dst_fd, dst_start, SEEK_SET) == -1) {
-			copyfile_warn("unable to reset file descriptors to punch holes");
-			// We have still copied the data, so there's no need to return an error here.
-			goto set_total_copied;
+					if (hole > offset)
+						data_end = MIN(hole, src_end);
+				}
+			}
 		}
 
-		// Now, find holes in the source (first_hole_offset already points to a source hole),
-		// determining their length by the presence of a data section.
-		while ((hole_end = lseek(src_fd, hole_start + (off_t) iosize, SEEK_DATA)) != -1) {
-			memset(&punchhole_args, 0, sizeof(punchhole_args));
+		while (offset < data_end) {
+			size_t left;
+			char *ptr = bp;
+			int loop = 0;
+
+			copyfile_throttle(s, 0, 1);
+			nread = pread(src_fd, bp, (size_t) MIN((off_t) iosize, data_end - offset), offset);
+			if (nread <= 0) {
+				// The source shrank (or failed) under us.
+				goto done;
+			}
+			copyfile_checksum_update(s, bp, nread);
+
+			for (left = (size_t) nread; left > 0; ) {
+				const off_t dst_offset = dst_start + (offset - src_start);
+				size_t len = left;
+				bool zeros = false;
+				ssize_t nwritten;
+
+				if (hole_size > 0 && offset >= src_dst_end)
+					len = copyfile_zero_span(ptr, len, dst_offset, hole_size, &zeros);
+				if (zeros) {
+					nwritten = (ssize_t) len;
+				} else {
+					copyfile_throttle(s, len, 1);
+					nwritten = pwrite(dst_fd, ptr, len, dst_offset);
+				}
+				if (nwritten == 0) {
+					if (++loop > 5) {
+						copyfile_warn("writing to output %d times resulted in 0 bytes written", loop);
+						errno = EAGAIN;
+						ret = -1;
+						goto done;
+					}
+					continue;
+				} else if (nwritten == -1) {
+					copyfile_warn("writing to output file got error");
+					if (status) {
+						int rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_ERR, s, s->src, s->dst, s->ctx);
+						if (rv == COPYFILE_SKIP) {	// Skip the data copy
+							*skipped = true;
+							goto done;
+						} else if (rv == COPYFILE_CONTINUE) {	// Retry the write
+							errno = 0;
+							continue;
+						}
+					}
+					ret = -1;
+					goto done;
+				}
 
-			// Fix up the offset and length for the destination file.
-			punchhole_args.fp_offset = hole_start - src_start + dst_start;
-			punchhole_args.fp_length = hole_end - hole_start;
-			if (fcntl(dst_fd, F_PUNCHHOLE, &punchhole_args) == -1) {
-				copyfile_warn("unable to punch hole in destination file, offset %lld length %lld",
-							  hole_start - src_start + dst_start, hole_end - hole_start);
-				goto set_total_copied;
+				loop = 0;
+				left -= (size_t) nwritten;
+				ptr += nwritten;
+				offset += nwritten;
+				s->totalCopied += nwritten;
+				if (copyfile_data_progress(s, false) == COPYFILE_QUIT) {
+					errno = ECANCELED;
+					ret = -1;
+					goto done;
+				}
 			}
+		}
+	}
+
+done:
+	if (nread < 0 && ret == 0) {
+		copyfile_warn("reading from %s", s->src ? s->src : "(null src)");
+		ret = -1;
+	}
+
+	// Make sure the destination covers the range, even if it ended in a hole.
+	if (ret == 0 && !*skipped && fstat(dst_fd, &dst_sb) == 0 &&
+		dst_sb.st_size < dst_start + (offset - src_start) &&
+		ftruncate(dst_fd, dst_start + (offset - src_start)) == -1) {
+		ret = -1;
+	}
+
+	if (ret == 0 && !*skipped && copyfile_data_progress(s, true) == COPYFILE_QUIT) {
+		errno = ECANCELED;
+		ret = -1;
+	}
+
+	if (src_saved != -1) {
+		const int saved_errno = errno;
+		(void)lseek(src_fd, src_saved, SEEK_SET);
+		errno = saved_errno;
+	}
+	free(bp);
+	return ret;
+}
+
+/*
+ * How far ahead of the copy a streaming copy asks for the source to be
+ * read, and how much of it may be copied before being let go of.
+ */
+#define COPYFILE_STREAM_WINDOW	(8 * 1024 * 1024)
+
+/*
+ * State for a streaming copy, which reads the source through the buffer
+ * cache (so that it can be read ahead of us) while keeping the amount
+ * of it cached to a small window behind and ahead of the copy.
+ */
+typedef struct copyfile_stream {
+	int	cs_src_fd;
+	bool	cs_src_nocache;	// F_NOCACHE was cleared on the source, and must be set again
+	off_t	cs_start;	// where the copy began in the source
+	off_t	cs_advised;	// the source has been read ahead up to here
+	off_t	cs_released;	// the source has been let go of up to here
+} copyfile_stream_t;
+
+/*
+ * Note that the copy has reached copied bytes past where it began:
+ * ask for the next window of the source to be read ahead once we are
+ * halfway through the last one, and deactivate the pages we are done with
+ * (so that they are the first to be reclaimed) a window at a time.
+ */
+static void copyfile_stream_advance(copyfile_stream_t *cs, off_t copied)
+{
+	const off_t pagemask = getpagesize() - 1;
+	const off_t offset = cs->cs_start + copied;
 
-			// Now, find the start of the next hole.
-			hole_start = lseek(src_fd, hole_end, SEEK_HOLE);
-			if (hole_start == -1 || hole_start == src_size) {
-				// No more holes (or lseek failed), so break.
-				trailing_hole = false;
-				break;
-			}
-		}
+	if (offset + (COPYFILE_STREAM_WINDOW / 2) >= cs->cs_advised) {
+		struct radvisory ra;
 
-		if ((hole_end == -1 || hole_start == -1) && errno != ENXIO) {
-			// A call to lseek() failed. Hole punching is best effort, so exit.
-			copyfile_warn("lseek during hole punching failed");
-			goto set_total_copied;
-		}
+		ra.ra_offset = MAX(cs->cs_advised, offset);
+		ra.ra_count = (int) (offset + COPYFILE_STREAM_WINDOW - ra.ra_offset);
+		(void)fcntl(cs->cs_src_fd, F_RDADVISE, &ra);
+		cs->cs_advised = offset + COPYFILE_STREAM_WINDOW;
+	}
 
-		// We will still have a trailing hole to punch if the last lseek(SEEK_HOLE) succeeded.
-		if (trailing_hole) {
-			// Since we can only punch iosize-aligned holes, we must make sure the last hole
-			// is iosize-aligned. Unfortunately, no good truncate macros are in scope here,
-			// so we must round down the end of the trailing hole to an iosize boundary ourselves.
-			hole_end = (src_size % iosize == 0) ? src_size : roundup(src_size, iosize) - iosize;
+	if (offset - cs->cs_released >= COPYFILE_STREAM_WINDOW) {
+		const off_t start = cs->cs_released & ~pagemask;
+		const size_t len = (size_t) ((offset & ~pagemask) - start);
+		void *map;
 
-			memset(&punchhole_args, 0, sizeof(punchhole_args));
-			punchhole_args.fp_offset = hole_start - src_start + dst_start;
-			punchhole_args.fp_length = hole_end - hole_start;
-			if (fcntl(dst_fd, F_PUNCHHOLE, &punchhole_args) == -1) {
-				copyfile_warn("unable to punch trailing hole in destination file, offset %lld",
-							  hole_start - src_start + dst_start);
-				goto set_total_copied;
-			}
+		// Mapping the range does not fault it in, but lets us reach its pages.
+		map = mmap(NULL, len, PROT_READ, MAP_SHARED, cs->cs_src_fd, start);
+		if (map != MAP_FAILED) {
+			(void)msync(map, len, MS_DEACTIVATE);
+			(void)munmap(map, len);
 		}
+		cs->cs_released = start + (off_t) len;
 	}
+}
 
-set_total_copied:
-	// Since we don't know in advance how many bytes we're copying, we advance this number
-	// as we copy, but to match copyfile_data() we set it here to the amount of bytes that would
-	// have been transferred in a full copy.
-	s->totalCopied = src_size - src_start;
+/*
+ * Start streaming from src_fd's current offset.
+ * Returns false (having changed nothing) if we cannot.
+ * Undo with copyfile_stream_finish().
+ */
+static bool copyfile_stream_start(copyfile_state_t s, copyfile_stream_t *cs, int src_fd)
+{
+	off_t offset;
 
-exit:
-	if (bp) {
-		free(bp);
-		bp = NULL;
-	}
+	if ((offset = lseek(src_fd, 0, SEEK_CUR)) < 0)
+		return false;
 
-	return rc;
+	// The source can only be read ahead through the cache.
+	// We only know that it bypasses the cache (and can say so again
+	// once we are done) if we opened it, or fcopyfile() was asked to
+	// set F_NOCACHE on it; otherwise, our caller's setting is left alone.
+	// (The destination's setting is never changed.)
+	cs->cs_src_nocache = (s->internal_flags & (cfSrcFdOpenedByUs | cfNoCacheData)) != 0;
+	if (cs->cs_src_nocache && fcntl(src_fd, F_NOCACHE, 0) == -1)
+		return false;
 
-error_exit:
-	s->err = errno;
-	rc = -1;
-	goto exit;
+	cs->cs_src_fd = src_fd;
+	cs->cs_start = cs->cs_advised = cs->cs_released = offset;
+	copyfile_stream_advance(cs, 0);
+
+	return true;
 }
 
 /*
- * Calculate the input (source file) and output (destination) block sizes,
- * using any provided by the state if valid.
- * Our output block size can be no greater than our input block size,
- * and is also limited by the source file size.
+ * Stop streaming, and let the source bypass the cache again if it did before.
  */
-static void copyfile_get_bsizes(copyfile_state_t s, bool copy_rsrc, copyfile_bsizes_t *bsizes)
+static void copyfile_stream_finish(copyfile_stream_t *cs)
 {
-	size_t iBlocksize = 0, iMinblocksize = 0;
-	size_t oBlocksize = 0, oMinblocksize = 0; // If 0, we don't support sparse copying.
-	const size_t blocksize_limit = 1 << 30; // 1 GiB
-
-	struct stat *sb;
-	int src_fd = -1, dst_fd = -1;
-	struct statfs sfs;
-
-	// Determine the file descriptors / stat buffers to look at
-	// (it is the caller's responsibility to make sure these are valid).
-	src_fd = copy_rsrc ? s->src_rsrc_fd : s->src_fd;
-	dst_fd = copy_rsrc ? s->dst_rsrc_fd : s->dst_fd;
-	sb = copy_rsrc ? s->rsrc_sb : &s->sb;
+	if (cs->cs_src_nocache)
+		(void)fcntl(cs->cs_src_fd, F_NOCACHE, 1);
+}
 
-	// Get default and fall-back values for the input blocksize.
-	if (fstatfs(src_fd, &sfs) == -1) {
-		iBlocksize = sb->st_blksize;
-	} else {
-		iBlocksize = sfs.f_iosize;
-		iMinblocksize = sfs.f_bsize;
-	}
+/*
+ * State for finding the I/O size that copies fastest between two devices.
+ * Each candidate size is timed over at least COPYFILE_TUNE_PROBE_SIZE bytes.
+ */
+typedef struct copyfile_bsize_tuner {
+	dev_t		cbt_src_dev;
+	dev_t		cbt_dst_dev;
+	size_t		cbt_min_bsize;
+	size_t		cbt_max_bsize;
+	size_t		cbt_initial_bsize;
+	size_t		cbt_bsize;	// the size being timed
+	size_t		cbt_best_bsize;
+	uint64_t	cbt_best_rate;	// in bytes per second
+	uint64_t	cbt_start;	// when we started timing cbt_bsize
+	uint64_t	cbt_bytes;	// bytes copied since then
+	int		cbt_step;	// 1 if growing, -1 if shrinking, 0 once settled
+} copyfile_bsize_tuner_t;
+
+static void copyfile_bsize_tuner_init(copyfile_bsize_tuner_t *t, dev_t src_dev, dev_t dst_dev,
+	size_t min_bsize, size_t bsize)
+{
+	memset(t, 0, sizeof(*t));
+	t->cbt_src_dev = src_dev;
+	t->cbt_dst_dev = dst_dev;
+	t->cbt_min_bsize = MAX(min_bsize, COPYFILE_TUNE_MIN_BSIZE);
+	t->cbt_max_bsize = MAX(t->cbt_min_bsize, COPYFILE_TUNE_MAX_BSIZE);
+	t->cbt_initial_bsize = MIN(MAX(bsize, t->cbt_min_bsize), t->cbt_max_bsize);
+	t->cbt_bsize = t->cbt_best_bsize = t->cbt_initial_bsize;
+	t->cbt_step = 1;
+	t->cbt_start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
 
-	// Get default and fall-back values for the output blocksize.
-	if (fstatfs(dst_fd, &sfs) == -1) {
-		oBlocksize = iBlocksize;
+/*
+ * Account for nbytes more having been copied with the current size.
+ * Starting from the initial size, we keep doubling it while that helps
+ * (by more than 10%), or if the first doubling doesn't, halve it while
+ * that helps instead, and then settle on (and remember) the fastest.
+ * Returns the size to use from now on.
+ */
+static size_t copyfile_bsize_tuner_update(copyfile_state_t s, copyfile_bsize_tuner_t *t, size_t nbytes)
+{
+	uint64_t now, rate;
+	size_t next;
+
+	if (t->cbt_step == 0)
+		return t->cbt_bsize;
+
+	t->cbt_bytes += nbytes;
+	if (t->cbt_bytes < MAX((uint64_t) COPYFILE_TUNE_PROBE_SIZE, 4 * (uint64_t) t->cbt_bsize))
+		return t->cbt_bsize;
+
+	now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	rate = (t->cbt_bytes * NSEC_PER_SEC) / MAX(now - t->cbt_start, 1);
+	copyfile_debug(4, "%zu byte I/Os copied at %llu bytes/sec", t->cbt_bsize, rate);
+
+	if (rate > t->cbt_best_rate + (t->cbt_best_rate / 10)) {
+		t->cbt_best_rate = rate;
+		t->cbt_best_bsize = t->cbt_bsize;
+	} else if (t->cbt_step > 0 && t->cbt_best_bsize == t->cbt_initial_bsize) {
+		// Larger I/Os didn't help; see whether smaller ones do.
+		t->cbt_step = -1;
 	} else {
-		oBlocksize = (sfs.f_iosize == 0) ? iBlocksize : MIN((size_t) sfs.f_iosize, iBlocksize);
-		oMinblocksize = sfs.f_bsize;
-	}
-
-	// If the user has provided a valid source blocksize, use it instead.
-	if (s->src_bsize >= iMinblocksize) {
-		iBlocksize = s->src_bsize;
+		t->cbt_step = 0;
 	}
 
-	// If the user has provided a valid destination blocksize, use it instead,
-	// unless it is larger than the source blocksize.
-	if (s->dst_bsize >= oMinblocksize && s->dst_bsize <= iBlocksize) {
-		oBlocksize = s->dst_bsize;
+	if (t->cbt_step > 0 && t->cbt_best_bsize * 2 > t->cbt_max_bsize) {
+		t->cbt_step = (t->cbt_best_bsize == t->cbt_initial_bsize) ? -1 : 0;
 	}
-
-	// 6453525 and 34848916 require us to limit our blocksize to resonable values.
-	if ((size_t) sb->st_size < iBlocksize && iMinblocksize > 0) {
-		copyfile_debug(3, "rounding up block size from fsize: %lld to multiple of %zu\n",
-			s->sb.st_size, iMinblocksize);
-		iBlocksize = roundup((size_t) sb->st_size, iMinblocksize);
-		oBlocksize = MIN(oBlocksize, iBlocksize);
+	if (t->cbt_step < 0 && t->cbt_best_bsize / 2 < t->cbt_min_bsize) {
+		t->cbt_step = 0;
 	}
 
-	if (iBlocksize > blocksize_limit) {
-		iBlocksize = blocksize_limit;
-		oBlocksize = MIN(oBlocksize, iBlocksize);
+	if (t->cbt_step == 0) {
+		copyfile_debug(3, "settled on %zu byte I/Os", t->cbt_best_bsize);
+		copyfile_tuned_bsize_save(t->cbt_src_dev, t->cbt_dst_dev, t->cbt_best_bsize);
+		next = t->cbt_best_bsize;
+	} else {
+		next = (t->cbt_step > 0) ? t->cbt_best_bsize * 2 : t->cbt_best_bsize / 2;
 	}
 
-	// Save our decided values.
-	bsizes->cb_src_bsize = iBlocksize;
-	bsizes->cb_src_minbsize = iMinblocksize;
-	bsizes->cb_dst_bsize = oBlocksize;
-	bsizes->cb_dst_minbsize = oMinblocksize;
-
-	// Make sure any system calls we made here that failed
-	// don't set any user-visible error.
-	errno = 0;
+	t->cbt_bsize = next;
+	t->cbt_bytes = 0;
+	t->cbt_start = now;
+	return next;
 }
 
 /*
@@ -2895,13 +5649,22 @@ static void copyfile_get_bsizes(copyfile_state_t s, bool copy_rsrc, copyfile_bsi
 static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 {
 	size_t blen;
-	char *bp = 0;
+	char *bp = 0, *rbuf = NULL;
 	ssize_t nread;
 	off_t totalCopied = 0;
 	size_t iBlocksize = 0, iMinblocksize = 0;
 	size_t oBlocksize = 0, oMinblocksize = 0;
 	copyfile_callback_t status = s->statuscb;
 	copyfile_bsizes_t copy_bsizes = {0};
+	copyfile_pipeline_t *pipeline = NULL;
+	copyfile_bsize_tuner_t tuner;
+	bool tuning = false;
+	copyfile_stream_t stream;
+	bool streaming = false;
+	off_t resumed = 0, checkpointed = 0;
+	bool checkpointing = false;
+	size_t hole_size = 0;
+	off_t dst_base = 0;
 	bool use_errno = true;
 	int src_fd = -1, dst_fd = -1;
 	int ret = 0;
@@ -2911,7 +5674,7 @@ static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 		return 0;
 
 #ifdef DECMPFS_XATTR_NAME
-	if (!copy_rsrc && (s->internal_flags & cfPreserveCompression)) {
+	if (!copy_rsrc && (s->internal_flags & cfPreserveCompression) && s->range_length == 0) {
 		// Set UF_COMPRESSED immediately and preserve existing st_flags.
 		//
 		// Since compression transfers the entirety of src to dst, we skip
@@ -2920,6 +5683,16 @@ static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 		const bool src_at_start = (s->internal_flags & cfSrcFdOpenedByUs) || lseek(s->src_fd, 0, SEEK_CUR) == 0;
 		const bool dst_at_start = (s->internal_flags & cfDstFdOpenedByUs) || lseek(s->dst_fd, 0, SEEK_CUR) == 0;
 		if (src_at_start && dst_at_start) {
+			// copyfile_open() leaves the destination of a checkpointed copy as it was,
+			// in case we could resume; compressed data replaces all of it (and the
+			// checkpoint) though, or UF_COMPRESSED would be set over the old data fork.
+			if (s->checkpoint_bytes > 0 && (s->flags & COPYFILE_DATA)) {
+				if ((s->internal_flags & cfDstFdOpenedByUs) && ftruncate(s->dst_fd, 0) == -1) {
+					ret = -1;
+					goto exit;
+				}
+				copyfile_checkpoint_clear(s, s->dst_fd);
+			}
 			if (copyfile_set_bsdflags(s, UF_COMPRESSED, UINT32_MAX) == 0) {
 				struct stat dst_sb;
 				if ((fstat(s->dst_fd, &dst_sb) == 0) && (dst_sb.st_flags & UF_COMPRESSED)) {
@@ -2945,21 +5718,60 @@ static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 
 	if (!copy_rsrc) {
 		s->totalCopied = 0;
+		s->internal_flags &= ~cfStreamedData;
+		s->progress_last_copied = 0;
+		s->progress_last_time = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+		s->checksum = 0;
+		s->delta_written = 0;
+		s->resumed_offset = 0;
+		s->internal_flags &= ~cfCheckpointedData;
+	}
+
+	// If requested, record our progress on the destination as we go,
+	// and pick up where an earlier copy of the same source left off.
+	// This only makes sense for whole files.
+	if (!copy_rsrc && s->checkpoint_bytes > 0 && (s->flags & COPYFILE_DATA) && s->range_length == 0 &&
+		lseek(s->src_fd, 0, SEEK_CUR) == 0 && lseek(s->dst_fd, 0, SEEK_CUR) == 0) {
+		checkpointing = true;
+		checkpointed = resumed = copyfile_checkpoint_load(s, s->dst_fd);
+		if (resumed > 0) {
+			if (lseek(s->src_fd, resumed, SEEK_SET) != resumed ||
+				lseek(s->dst_fd, resumed, SEEK_SET) != resumed) {
+				ret = -1;
+				goto exit;
+			}
+			// Whatever was written after the checkpoint can't be trusted,
+			// and must not show through any holes we leave.
+			if (ftruncate(s->dst_fd, resumed) == -1) {
+				ret = -1;
+				goto exit;
+			}
+			copyfile_debug(3, "resuming copy at offset %lld", (long long) resumed);
+			s->internal_flags |= cfCheckpointedData;
+			s->resumed_offset = resumed;
+			s->totalCopied = s->progress_last_copied = totalCopied = resumed;
+		} else if ((s->internal_flags & cfDstFdOpenedByUs) && !(s->flags & COPYFILE_DATA_DELTA) &&
+			ftruncate(s->dst_fd, 0) == -1) {
+			// copyfile_open() left the destination as it was, in case we could resume.
+			ret = -1;
+			goto exit;
+		}
 	}
 
 	// If requested, attempt a sparse copy.
-	if (!copy_rsrc && s->flags & COPYFILE_DATA_SPARSE) {
+	if (!copy_rsrc && s->flags & COPYFILE_DATA_SPARSE && resumed == 0 && s->range_length == 0) {
 		// Check if the source & destination volumes both support sparse files.
-		long min_hole_size = MIN(fpathconf(s->src_fd, _PC_MIN_HOLE_SIZE),
-								 fpathconf(s->dst_fd, _PC_MIN_HOLE_SIZE));
+		long src_hole_size = fpathconf(s->src_fd, _PC_MIN_HOLE_SIZE);
+		long dst_hole_size = fpathconf(s->dst_fd, _PC_MIN_HOLE_SIZE);
 
-		// If holes are supported on both the source and dest volumes, make sure our min_hole_size
-		// is reasonable: if it's smaller than the source/dest block size,
+		// If holes are supported on both the source and dest volumes, make sure each one's
+		// min_hole_size is reasonable: if it's smaller than that volume's block size,
 		// our copy performance will suffer (and we may not create sparse files).
-		if (iMinblocksize > 0 && oMinblocksize > 0 && (size_t) min_hole_size >= iMinblocksize
-			&& (size_t) min_hole_size >= oMinblocksize) {
+		// The two block sizes need not match, as we punch whole destination blocks.
+		if (iMinblocksize > 0 && oMinblocksize > 0 && (size_t) src_hole_size >= iMinblocksize
+			&& (size_t) dst_hole_size >= oMinblocksize) {
 			// Do the copy.
-			ret = copyfile_data_sparse(s, iMinblocksize, oMinblocksize);
+			ret = copyfile_data_sparse(s, &copy_bsizes);
 
 			// If we returned an error, exit gracefully.
 			// If sparse copying is not supported, we try full copying if allowed by our caller.
@@ -2982,48 +5794,159 @@ static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 	src_fd = copy_rsrc ? s->src_rsrc_fd : s->src_fd;
 	dst_fd = copy_rsrc ? s->dst_rsrc_fd : s->dst_fd;
 
-	if ((bp = malloc(iBlocksize)) == NULL)
-		return -1;
+	// If requested, leave holes in the destination (where it supports them)
+	// for whole blocks of zeros, rather than writing them out.
+	// That is only safe where the destination has no data of its own to show
+	// through them: a range copy checks as it goes, but anything else must
+	// be writing at the end of the destination (as it is once truncated).
+	if (!copy_rsrc && (s->internal_flags & cfSkipZeros)) {
+		long min_hole_size = fpathconf(dst_fd, _PC_MIN_HOLE_SIZE);
+
+		if (min_hole_size > 0 && (dst_base = lseek(dst_fd, 0, SEEK_CUR)) >= 0 &&
+			(s->range_length > 0 || copyfile_dst_unwritten_from(dst_fd, dst_base))) {
+			hole_size = MAX((size_t) min_hole_size, oMinblocksize);
+			dst_base -= totalCopied;
+			copyfile_debug(3, "skipping %zu-byte blocks of zeros", hole_size);
+		} else if (min_hole_size > 0 && dst_base >= 0) {
+			copyfile_debug(3, "destination has data past offset %lld, writing out zeros", (long long) dst_base);
+		}
+	}
+
+	// If requested, copy just part of the source, to part of the destination.
+	if (!copy_rsrc && s->range_length > 0) {
+		bool skipped = false;
+
+		ret = copyfile_data_range(s, src_fd, dst_fd, oBlocksize, hole_size, &skipped);
+		goto exit;
+	}
+
+	// (Space reserved for the destination would stay taken by any blocks of zeros we skip.)
+	if (hole_size == 0)
+		copyfile_preallocate(s, dst_fd, copy_rsrc ? s->rsrc_sb->st_size : s->sb.st_size);
+
+	// If requested, only rewrite the parts of an existing destination that differ.
+	if (!copy_rsrc && (s->flags & COPYFILE_DATA_DELTA) && resumed == 0) {
+		bool skipped = false;
+
+		ret = copyfile_data_delta(s, src_fd, dst_fd, oBlocksize, &totalCopied, &skipped);
+		if (ret == 0 && skipped) {
+			goto exit;
+		} else if (ret == 0) {
+			goto truncate;
+		} else if (ret != ENOTSUP) {
+			goto exit;
+		}
+		ret = 0;
+	}
+
+	// If requested, copy the data with several threads,
+	// keep several reads and writes in flight at once,
+	// or (for large enough files) write it from a mapping of the source.
+	// (Only the loop below records checkpoints, skips zeros or is rate-limited.)
+	if (!copy_rsrc && !checkpointing && hole_size == 0 && !copyfile_limiter_active(s->limiter) && (s->data_threads > 1 || s->data_qdepth > 1 ||
+		(s->mmap_threshold > 0 && s->sb.st_size >= s->mmap_threshold)) &&
+		(size_t) s->sb.st_size > oBlocksize) {
+		bool skipped = false;
+
+		// Data written out of order can't be checksummed as it is written.
+		const bool in_order = (s->checksum_alg == COPYFILE_CHECKSUM_NONE);
+
+		ret = ENOTSUP;
+		if (s->data_threads > 1 && in_order) {
+			ret = copyfile_data_parallel(s, src_fd, dst_fd, oBlocksize, &totalCopied, &skipped);
+		}
+		if (ret == ENOTSUP && s->data_qdepth > 1 && in_order) {
+			ret = copyfile_data_aio(s, src_fd, dst_fd, oBlocksize, &totalCopied, &skipped);
+		}
+		if (ret == ENOTSUP && s->mmap_threshold > 0 && s->sb.st_size >= s->mmap_threshold) {
+			// This may copy part of the file, leaving the rest to the loop below.
+			ret = copyfile_data_mmap(s, src_fd, dst_fd, oBlocksize, &totalCopied, &skipped);
+		}
+		if (ret == 0 && skipped) {
+			goto exit;
+		} else if (ret == 0) {
+			goto truncate;
+		} else if (ret != ENOTSUP) {
+			goto exit;
+		}
+		ret = 0;
+	}
 
 	blen = iBlocksize;
 
-	/* If supported, do preallocation for Xsan / HFS / apfs volumes */
-#ifdef F_PREALLOCATE
-	{
-		const off_t src_bytes_allocated = copy_rsrc ? s->rsrc_sb->st_size : s->sb.st_size;
-		off_t dst_bytes_allocated = 0;
+	// If requested, read ahead on another thread while we write,
+	// when the source and destination are on different devices.
+	if (s->internal_flags & cfPipelineData) {
+		struct stat src_sb, dst_sb;
+
+		if (fstat(src_fd, &src_sb) == 0 && fstat(dst_fd, &dst_sb) == 0 &&
+			src_sb.st_dev != dst_sb.st_dev) {
+			pipeline = copyfile_pipeline_start(src_fd, blen);
+			copyfile_debug(3, "%s read-ahead pipeline", pipeline ? "using" : "unable to start");
+		}
+	}
+
+	// If requested, find the fastest I/O size between these devices as we go
+	// (unless we already know it, or the user has chosen one).
+	if (!copy_rsrc && pipeline == NULL && (s->internal_flags & cfAdaptiveBsize) &&
+		s->tuned_bsize == 0 && s->src_bsize == 0 && s->dst_bsize == 0 &&
+		s->sb.st_size >= COPYFILE_TUNE_MIN_FILE_SIZE) {
 		struct stat dst_sb;
 
 		if (fstat(dst_fd, &dst_sb) == 0) {
-			// The destination may already have
-			// preallocated space we can use.
-			dst_bytes_allocated = dst_sb.st_blocks * S_BLKSIZE;
+			copyfile_bsize_tuner_init(&tuner, s->sb.st_dev, dst_sb.st_dev,
+				MAX(iMinblocksize, oMinblocksize), oBlocksize);
+			tuning = true;
+			blen = oBlocksize = tuner.cbt_bsize;
+			copyfile_debug(3, "tuning I/O size, starting from %zu", blen);
 		}
+	}
 
-		if (dst_bytes_allocated < src_bytes_allocated) {
-			fstore_t fst;
+	if (pipeline == NULL) {
+		const size_t bsize = tuning ? tuner.cbt_max_bsize : blen;
 
-			fst.fst_flags = 0;
-			fst.fst_posmode = F_PEOFPOSMODE;
-			fst.fst_offset = 0;
-			fst.fst_length = src_bytes_allocated - dst_bytes_allocated;
+		// In a batch, reuse the buffer from the last copy (or keep this one for the next).
+		if (s->batch != NULL && s->batch_buffer_size >= bsize) {
+			bp = s->batch_buffer;
+		} else if ((bp = copyfile_data_buffer_alloc(bsize)) == NULL) {
+			return -1;
+		} else if (s->batch != NULL) {
+			free(s->batch_buffer);
+			s->batch_buffer = bp;
+			s->batch_buffer_size = bsize;
+		}
+	}
 
-			copyfile_debug(3, "preallocating %lld bytes on destination", fst.fst_length);
-			/* Ignore errors; this is merely advisory. */
-			(void)fcntl(dst_fd, F_PREALLOCATE, &fst);
+	// If requested, keep the source's cached pages to a small window around the copy.
+	if (!copy_rsrc && (s->internal_flags & cfStreamData)) {
+		streaming = copyfile_stream_start(s, &stream, src_fd);
+		if (streaming) {
+			s->internal_flags |= cfStreamedData;
+			copyfile_debug(3, "streaming through a %d MB window", COPYFILE_STREAM_WINDOW / (1024 * 1024));
 		}
 	}
-#endif
 
-	while ((nread = read(src_fd, bp, blen)) > 0)
+	while ((nread = copyfile_data_read(src_fd, bp, blen, pipeline, &rbuf)) > 0)
 	{
 		ssize_t nwritten;
 		size_t left = nread;
-		void *ptr = bp;
+		void *ptr = rbuf;
 		int loop = 0;
 
+		copyfile_throttle(s, 0, 1);
+
 		while (left > 0) {
-			nwritten = write(dst_fd, ptr, MIN(left, oBlocksize));
+			size_t len = MIN(left, oBlocksize);
+			bool zeros = false;
+
+			if (hole_size > 0)
+				len = copyfile_zero_span(ptr, len, dst_base + totalCopied, hole_size, &zeros);
+			if (zeros) {	// The final ftruncate() will cover any trailing hole.
+				nwritten = (lseek(dst_fd, (off_t) len, SEEK_CUR) == -1) ? -1 : (ssize_t) len;
+			} else {
+				copyfile_throttle(s, len, 1);
+				nwritten = write(dst_fd, ptr, len);
+			}
 			switch (nwritten) {
 				case 0:
 					if (++loop > 5) {
@@ -3066,6 +5989,9 @@ static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 					ret = -1;
 					goto exit;
 				default:
+					if (!copy_rsrc) {
+						copyfile_checksum_update(s, ptr, nwritten);
+					}
 					left -= nwritten;
 					ptr = ((char*)ptr) + nwritten;
 					loop = 0;
@@ -3075,15 +6001,33 @@ static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 			totalCopied += nwritten;
 			if (!copy_rsrc) {
 				s->totalCopied += nwritten;
-				if (status) {
-					int rv = (*status)(COPYFILE_COPY_DATA, COPYFILE_PROGRESS, s, s->src, s->dst, s->ctx);
-					if (rv == COPYFILE_QUIT) {
-						ret = -1; s->err = errno = ECANCELED;
-						goto exit;
-					}
+				if (copyfile_data_progress(s, false) == COPYFILE_QUIT) {
+					ret = -1; s->err = errno = ECANCELED;
+					goto exit;
 				}
 			}
 		}
+
+		if (streaming) {
+			copyfile_stream_advance(&stream, totalCopied - resumed);
+		}
+
+		if (checkpointing && totalCopied - checkpointed >= s->checkpoint_bytes) {
+			if (copyfile_checkpoint_save(s, dst_fd, totalCopied) == 0) {
+				checkpointed = totalCopied;
+			} else {
+				copyfile_warn("unable to record a checkpoint, continuing without");
+				checkpointing = false;
+			}
+		}
+
+		if (tuning) {
+			blen = oBlocksize = copyfile_bsize_tuner_update(s, &tuner, (size_t) nread);
+			if (tuner.cbt_step == 0) {
+				s->tuned_bsize = (uint32_t) blen;
+				tuning = false;
+			}
+		}
 	}
 	if (nread < 0)
 	{
@@ -3092,6 +6036,7 @@ static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 		goto exit;
 	}
 
+truncate:
 	// This is wrong if fcopyfile() is given a dst_fd with a non-zero starting
 	// offset, but we need to preserve the existing behavior for compatibility.
 	if (ftruncate(dst_fd, totalCopied) < 0)
@@ -3100,12 +6045,28 @@ static int copyfile_data(copyfile_state_t s, bool copy_rsrc)
 		goto exit;
 	}
 
+	// If progress callbacks were coalesced, report the last of the data.
+	if (!copy_rsrc && copyfile_data_progress(s, true) == COPYFILE_QUIT) {
+		ret = -1; s->err = errno = ECANCELED;
+		goto exit;
+	}
+
 exit:
 	if (ret == -1 && use_errno)
 	{
 		s->err = errno;
 	}
-	free(bp);
+	if (ret == 0 && !copy_rsrc && s->checkpoint_bytes > 0)
+	{
+		// The copy is complete (or was skipped); there is nothing to resume.
+		copyfile_checkpoint_clear(s, s->dst_fd);
+	}
+	if (pipeline)
+		copyfile_pipeline_stop(pipeline);
+	if (streaming)
+		copyfile_stream_finish(&stream);
+	if (bp != s->batch_buffer)
+		free(bp);
 	return ret;
 }
 
@@ -3458,6 +6419,7 @@ static int copyfile_rsrc(copyfile_state_t s, void **xa_buf, ssize_t *buf_size, i
 	while ((nread = fgetxattr(s->src_fd, XATTR_RESOURCEFORK_NAME, buf,
 			(size_t)*buf_size, rsrc_pos, look_for_decmpea)) > 0) {
 
+		copyfile_throttle(s, (size_t) nread, 2);
 		if (fsetxattr(s->dst_fd, XATTR_RESOURCEFORK_NAME, buf, nread, rsrc_pos, look_for_decmpea) < 0) {
 			copyfile_warn("writing to resource fork got error");
 
@@ -3563,6 +6525,10 @@ dst_restart:
 				if (strncmp(name, XATTR_QUARANTINE_NAME, end - name) == 0) {
 					continue;
 				}
+				/* copyfile_data() may resume from a checkpoint, and will remove it itself */
+				if (strncmp(name, XATTR_CHECKPOINT_NAME, end - name) == 0) {
+					continue;
+				}
 				fremovexattr(s->dst_fd, name,0);
 			}
 		}
@@ -3667,6 +6633,10 @@ src_restart:
 		if (strncmp(name, XATTR_QUARANTINE_NAME, end - name) == 0)
 			continue;
 
+		/* A checkpoint only describes the file it is on */
+		if (strncmp(name, XATTR_CHECKPOINT_NAME, end - name) == 0)
+			continue;
+
 		// If we have a copy intention stated, and the EA is to be ignored, we ignore it
 		if (s->copyIntent
 			&& xattr_preserve_for_intent(name, s->copyIntent) == 0)
@@ -3929,7 +6899,7 @@ int copyfile_state_get(copyfile_state_t s, uint32_t flag, void *ret)
 			*(qtn_file_t*)ret = s->qinfo;
 			break;
 		case COPYFILE_STATE_STATUS_CB:
-			*(copyfile_callback_t*)ret = s->statuscb;
+			*(copyfile_callback_t*)ret = s->tree ? s->tree->ct_state->statuscb : s->statuscb;
 			break;
 		case COPYFILE_STATE_STATUS_CTX:
 			*(void**)ret = s->ctx;
@@ -3971,6 +6941,92 @@ int copyfile_state_get(copyfile_state_t s, uint32_t flag, void *ret)
 		case COPYFILE_STATE_FORBID_DST_EXISTING_SYMLINKS:
 			*(uint32_t*)ret = (s->internal_flags & cfDstCheckExistingSlinks) ? 1 : 0;
 			break;
+		case COPYFILE_STATE_QUEUE_DEPTH:
+			*(uint32_t*)ret = s->data_qdepth;
+			break;
+		case COPYFILE_STATE_THREADS:
+			*(uint32_t*)ret = s->data_threads;
+			break;
+		case COPYFILE_STATE_PIPELINE:
+			*(uint32_t*)ret = (s->internal_flags & cfPipelineData) ? 1 : 0;
+			break;
+		case COPYFILE_STATE_MMAP_THRESHOLD:
+			*(off_t*)ret = s->mmap_threshold;
+			break;
+		case COPYFILE_STATE_ADAPTIVE_BSIZE:
+			*(uint32_t*)ret = (s->internal_flags & cfAdaptiveBsize) ? 1 : 0;
+			break;
+		case COPYFILE_STATE_TUNED_BSIZE:
+			*(uint32_t*)ret = s->tuned_bsize;
+			break;
+		case COPYFILE_STATE_NOCACHE:
+			*(uint32_t*)ret = (s->internal_flags & cfNoCacheData) ? 1 : 0;
+			break;
+		case COPYFILE_STATE_STREAMING:
+			*(uint32_t*)ret = (s->internal_flags & cfStreamData) ? 1 : 0;
+			break;
+		case COPYFILE_STATE_WAS_STREAMED:
+			*(bool *)ret = ((s->internal_flags & cfStreamedData) == cfStreamedData);
+			break;
+		case COPYFILE_STATE_PROGRESS_BYTES:
+			*(off_t*)ret = s->progress_bytes;
+			break;
+		case COPYFILE_STATE_PROGRESS_MSECS:
+			*(uint32_t*)ret = s->progress_msecs;
+			break;
+		case COPYFILE_STATE_CHECKSUM_ALG:
+			*(uint32_t*)ret = s->checksum_alg;
+			break;
+		case COPYFILE_STATE_CHECKSUM:
+			*(uint32_t*)ret = s->checksum;
+			break;
+		case COPYFILE_STATE_DELTA_WRITTEN:
+			*(off_t*)ret = s->delta_written;
+			break;
+		case COPYFILE_STATE_CHECKPOINT_BYTES:
+			*(off_t*)ret = s->checkpoint_bytes;
+			break;
+		case COPYFILE_STATE_RESUMED_OFFSET:
+			*(off_t*)ret = s->resumed_offset;
+			break;
+		case COPYFILE_STATE_SKIP_ZEROS:
+			*(uint32_t*)ret = (s->internal_flags & cfSkipZeros) ? 1 : 0;
+			break;
+		case COPYFILE_STATE_BYTES_PER_SEC:
+		{
+			uint32_t iops;
+
+			copyfile_limiter_get(s->limiter, (off_t*)ret, &iops);
+			break;
+		}
+		case COPYFILE_STATE_IOPS:
+		{
+			off_t bytes_per_sec;
+
+			copyfile_limiter_get(s->limiter, &bytes_per_sec, (uint32_t*)ret);
+			break;
+		}
+		case COPYFILE_STATE_LIMITER:
+			*(copyfile_limiter_t*)ret = s->limiter;
+			break;
+		case COPYFILE_STATE_RANGE_SRC_OFFSET:
+			*(off_t*)ret = s->range_src_offset;
+			break;
+		case COPYFILE_STATE_RANGE_DST_OFFSET:
+			*(off_t*)ret = s->range_dst_offset;
+			break;
+		case COPYFILE_STATE_RANGE_LENGTH:
+			*(off_t*)ret = s->range_length;
+			break;
+		case COPYFILE_STATE_BATCH_THREADS:
+			*(uint32_t*)ret = s->batch_threads;
+			break;
+		case COPYFILE_STATE_RECURSIVE_THREADS:
+			*(uint32_t*)ret = s->recursive_threads;
+			break;
+		case COPYFILE_STATE_CONCURRENT_CALLBACKS:
+			*(uint32_t*)ret = (s->internal_flags & cfConcurrentCallbacks) ? 1 : 0;
+			break;
 		default:
 			errno = EINVAL;
 			ret = NULL;
@@ -4072,6 +7128,122 @@ int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * thing)
 				s->internal_flags &= ~cfDstCheckExistingSlinks;
 			}
 			break;
+		case COPYFILE_STATE_QUEUE_DEPTH:
+			s->data_qdepth = *(uint32_t*)thing;
+			break;
+		case COPYFILE_STATE_THREADS:
+			s->data_threads = *(uint32_t*)thing;
+			break;
+		case COPYFILE_STATE_PIPELINE:
+			if ((*(uint32_t *)thing) > 0) {
+				s->internal_flags |= cfPipelineData;
+			} else {
+				s->internal_flags &= ~cfPipelineData;
+			}
+			break;
+		case COPYFILE_STATE_MMAP_THRESHOLD:
+			s->mmap_threshold = *(off_t*)thing;
+			break;
+		case COPYFILE_STATE_ADAPTIVE_BSIZE:
+			if ((*(uint32_t *)thing) > 0) {
+				s->internal_flags |= cfAdaptiveBsize;
+			} else {
+				s->internal_flags &= ~cfAdaptiveBsize;
+			}
+			break;
+		case COPYFILE_STATE_NOCACHE:
+			if ((*(uint32_t *)thing) > 0) {
+				s->internal_flags |= cfNoCacheData;
+			} else {
+				s->internal_flags &= ~cfNoCacheData;
+			}
+			break;
+		case COPYFILE_STATE_STREAMING:
+			if ((*(uint32_t *)thing) > 0) {
+				s->internal_flags |= cfStreamData;
+			} else {
+				s->internal_flags &= ~cfStreamData;
+			}
+			break;
+		case COPYFILE_STATE_PROGRESS_BYTES:
+			s->progress_bytes = *(off_t*)thing;
+			break;
+		case COPYFILE_STATE_PROGRESS_MSECS:
+			s->progress_msecs = *(uint32_t*)thing;
+			break;
+		case COPYFILE_STATE_CHECKSUM_ALG:
+			if (*(uint32_t*)thing > COPYFILE_CHECKSUM_CRC32C) {
+				errno = EINVAL;
+				return -1;
+			}
+			s->checksum_alg = *(uint32_t*)thing;
+			break;
+		case COPYFILE_STATE_CHECKPOINT_BYTES:
+			if (*(off_t*)thing < 0) {
+				errno = EINVAL;
+				return -1;
+			}
+			s->checkpoint_bytes = *(off_t*)thing;
+			break;
+		case COPYFILE_STATE_SKIP_ZEROS:
+			if ((*(uint32_t *)thing) > 0) {
+				s->internal_flags |= cfSkipZeros;
+			} else {
+				s->internal_flags &= ~cfSkipZeros;
+			}
+			break;
+		case COPYFILE_STATE_BYTES_PER_SEC:
+		case COPYFILE_STATE_IOPS:
+			if (flag == COPYFILE_STATE_BYTES_PER_SEC && *(off_t*)thing < 0) {
+				errno = EINVAL;
+				return -1;
+			}
+			// No limit needs no limiter (which would only keep us from
+			// using the engines that can't be limited).
+			if (s->limiter == NULL && (flag == COPYFILE_STATE_BYTES_PER_SEC ?
+				*(off_t*)thing == 0 : *(uint32_t*)thing == 0))
+				break;
+			if (s->limiter == NULL && (s->limiter = copyfile_limiter_alloc()) == NULL)
+				return -1;
+			if (flag == COPYFILE_STATE_BYTES_PER_SEC)
+				copyfile_limiter_set(s->limiter, *(off_t*)thing, -1);
+			else
+				copyfile_limiter_set(s->limiter, -1, *(uint32_t*)thing);
+			break;
+		case COPYFILE_STATE_LIMITER:
+		{
+			copyfile_limiter_t l = copyfile_limiter_retain(*(copyfile_limiter_t*)thing);
+
+			copyfile_limiter_release(s->limiter);
+			s->limiter = l;
+			break;
+		}
+		case COPYFILE_STATE_RANGE_SRC_OFFSET:
+		case COPYFILE_STATE_RANGE_DST_OFFSET:
+		case COPYFILE_STATE_RANGE_LENGTH:
+			if (*(off_t*)thing < 0) {
+				errno = EINVAL;
+				return -1;
+			}
+			if (flag == COPYFILE_STATE_RANGE_SRC_OFFSET)
+				s->range_src_offset = *(off_t*)thing;
+			else if (flag == COPYFILE_STATE_RANGE_DST_OFFSET)
+				s->range_dst_offset = *(off_t*)thing;
+			else
+				s->range_length = *(off_t*)thing;
+			break;
+		case COPYFILE_STATE_BATCH_THREADS:
+			s->batch_threads = *(uint32_t*)thing;
+			break;
+		case COPYFILE_STATE_RECURSIVE_THREADS:
+			s->recursive_threads = *(uint32_t*)thing;
+			break;
+		case COPYFILE_STATE_CONCURRENT_CALLBACKS:
+			if (*(uint32_t*)thing)
+				s->internal_flags |= cfConcurrentCallbacks;
+			else
+				s->internal_flags &= ~cfConcurrentCallbacks;
+			break;
 		default:
 			errno = EINVAL;
 			return -1;
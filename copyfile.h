@@ -33,6 +33,7 @@
 
 /* private */
 #include <sys/cdefs.h>
+#include <stddef.h>
 #include <stdint.h>
 
 __BEGIN_DECLS
@@ -40,6 +41,8 @@ __ptrcheck_abi_assume_single()
 struct _copyfile_state;
 typedef struct _copyfile_state * copyfile_state_t;
 typedef uint32_t copyfile_flags_t;
+struct _copyfile_limiter;
+typedef struct _copyfile_limiter * copyfile_limiter_t;
 
 /* public */
 
@@ -59,6 +62,14 @@ int fcopyfile(int from_fd, int to_fd, copyfile_state_t, copyfile_flags_t flags);
 int copyfile_state_free(copyfile_state_t);
 copyfile_state_t copyfile_state_alloc(void);
 
+typedef struct copyfile_batch_item {
+	const char *__unsafe_indexable	from;
+	const char *__unsafe_indexable	to;
+	int	result;	/* set to 0, or the error copying this item */
+} copyfile_batch_item_t;
+
+int copyfile_batch(copyfile_batch_item_t *__unsafe_indexable items, size_t count, copyfile_state_t state, copyfile_flags_t flags);
+
 
 int copyfile_state_get(copyfile_state_t s, uint32_t flag, void * dst);
 int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * src);
@@ -83,6 +94,36 @@ typedef int (*copyfile_callback_t)(int, int, copyfile_state_t, const char *__uns
 #define	COPYFILE_STATE_PRESERVE_SUID		16
 #define	COPYFILE_STATE_RECURSIVE_SRC_FTSENT	17
 #define	COPYFILE_STATE_FORBID_DST_EXISTING_SYMLINKS	18
+#define	COPYFILE_STATE_QUEUE_DEPTH	19
+#define	COPYFILE_STATE_THREADS	20
+#define	COPYFILE_STATE_PIPELINE	21
+#define	COPYFILE_STATE_MMAP_THRESHOLD	22
+#define	COPYFILE_STATE_ADAPTIVE_BSIZE	23
+#define	COPYFILE_STATE_TUNED_BSIZE	24
+#define	COPYFILE_STATE_NOCACHE	25
+#define	COPYFILE_STATE_STREAMING	26
+#define	COPYFILE_STATE_WAS_STREAMED	27
+#define	COPYFILE_STATE_PROGRESS_BYTES	28
+#define	COPYFILE_STATE_PROGRESS_MSECS	29
+#define	COPYFILE_STATE_CHECKSUM_ALG	30
+#define	COPYFILE_STATE_CHECKSUM	31
+#define	COPYFILE_STATE_DELTA_WRITTEN	32
+#define	COPYFILE_STATE_CHECKPOINT_BYTES	33
+#define	COPYFILE_STATE_RESUMED_OFFSET	34
+#define	COPYFILE_STATE_SKIP_ZEROS	35
+#define	COPYFILE_STATE_BYTES_PER_SEC	36
+#define	COPYFILE_STATE_IOPS	37
+#define	COPYFILE_STATE_LIMITER	38
+#define	COPYFILE_STATE_RANGE_SRC_OFFSET	39
+#define	COPYFILE_STATE_RANGE_DST_OFFSET	40
+#define	COPYFILE_STATE_RANGE_LENGTH	41
+#define	COPYFILE_STATE_BATCH_THREADS	42
+#define	COPYFILE_STATE_RECURSIVE_THREADS	43
+#define	COPYFILE_STATE_CONCURRENT_CALLBACKS	44
+
+/* Values for COPYFILE_STATE_CHECKSUM_ALG */
+#define	COPYFILE_CHECKSUM_NONE	0
+#define	COPYFILE_CHECKSUM_CRC32C	1
 
 
 #define	COPYFILE_DISABLE_VAR	"COPYFILE_DISABLE"
@@ -119,6 +160,8 @@ typedef int (*copyfile_callback_t)(int, int, copyfile_state_t, const char *__uns
 
 #define COPYFILE_PRESERVE_DST_TRACKED	(1<<28)
 
+#define COPYFILE_DATA_DELTA	(1<<29)
+
 #define COPYFILE_VERBOSE	(1<<30)
 
 #define	COPYFILE_RECURSE_ERROR	0
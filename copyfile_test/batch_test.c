@@ -0,0 +1,103 @@
+//
+//  batch_test.c
+//  copyfile_test
+//
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <removefile.h>
+#include <sys/fcntl.h>
+#include <sys/stat.h>
+
+#include "test_utils.h"
+
+REGISTER_TEST(batch, false, TIMEOUT_MIN(1));
+
+#define BATCH_SOURCE_NAME	"batch_source"
+#define BATCH_DESTINATION_NAME	"batch_destination"
+#define BATCH_COUNT	64
+
+static bool verify_batch_copy(const char *apfs_test_directory, uint32_t nthreads) {
+	char sources[BATCH_COUNT][BSIZE_B], destinations[BATCH_COUNT][BSIZE_B], missing[BSIZE_B];
+	copyfile_batch_item_t items[BATCH_COUNT + 1];
+	copyfile_state_t state;
+	off_t copied = 0, expected = 0;
+	int test_file_id, fd;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+
+	// Create files of different sizes (and one source that does not exist).
+	for (size_t i = 0; i < BATCH_COUNT; i++) {
+		char name[BSIZE_B];
+		size_t size = (i * 37 * KB) + i;
+		char *buf;
+
+		snprintf(name, sizeof(name), BATCH_SOURCE_NAME "_%zu", i);
+		create_test_file_name(apfs_test_directory, name, test_file_id, sources[i]);
+		snprintf(name, sizeof(name), BATCH_DESTINATION_NAME "_%zu", i);
+		create_test_file_name(apfs_test_directory, name, test_file_id, destinations[i]);
+
+		assert_with_errno((buf = malloc(size + 1)));
+		arc4random_buf(buf, size);
+		assert_fd(fd = open(sources[i], DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+		check_io(write(fd, buf, size), (ssize_t)size);
+		assert_no_err(close(fd));
+		free(buf);
+		expected += (off_t)size;
+
+		items[i].from = sources[i];
+		items[i].to = destinations[i];
+		items[i].result = -1;
+	}
+	snprintf(missing, sizeof(missing), "%s/" BATCH_SOURCE_NAME "_missing", apfs_test_directory);
+	items[BATCH_COUNT].from = missing;
+	items[BATCH_COUNT].to = destinations[0];
+	items[BATCH_COUNT].result = -1;
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_BATCH_THREADS, &nthreads));
+
+	// Every file should be copied, even though the last item (whose source does not exist) fails.
+	assert_call_fail(copyfile_batch(items, BATCH_COUNT + 1, state, COPYFILE_ALL|COPYFILE_EXCL), ENOENT);
+	for (size_t i = 0; i < BATCH_COUNT; i++) {
+		assert_equal_int(items[i].result, 0);
+		success &= verify_copy_contents(sources[i], destinations[i]);
+	}
+	assert_equal_int(items[BATCH_COUNT].result, ENOENT);
+
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_COPIED, &copied));
+	assert_equal_ll(copied, expected);
+
+	// With COPYFILE_EXCL, copying them again should fail for each one.
+	assert_call_fail(copyfile_batch(items, BATCH_COUNT, state, COPYFILE_DATA|COPYFILE_EXCL), EEXIST);
+	for (size_t i = 0; i < BATCH_COUNT; i++) {
+		assert_equal_int(items[i].result, EEXIST);
+	}
+	assert_no_err(copyfile_state_free(state));
+
+	// Copying them over themselves does nothing, successfully.
+	for (size_t i = 0; i < BATCH_COUNT; i++) {
+		items[i].to = sources[i];
+	}
+	assert_no_err(copyfile_batch(items, BATCH_COUNT, NULL, COPYFILE_DATA));
+
+	for (size_t i = 0; i < BATCH_COUNT; i++) {
+		(void)removefile(destinations[i], NULL, 0);
+		(void)removefile(sources[i], NULL, 0);
+	}
+
+	return success;
+}
+
+bool do_batch_test(const char *apfs_test_directory, __unused size_t block_size) {
+	bool success = true;
+
+	success &= verify_batch_copy(apfs_test_directory, 0);
+	success &= verify_batch_copy(apfs_test_directory, 4);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
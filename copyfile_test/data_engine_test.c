@@ -0,0 +1,1012 @@
+//
+//  data_engine_test.c
+//  copyfile_test
+//
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <removefile.h>
+#include <sys/fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "test_utils.h"
+
+REGISTER_TEST(data_qdepth, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_threads, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_pipeline, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_mmap, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_adaptive_bsize, false, TIMEOUT_MIN(2));
+REGISTER_TEST(data_nocache, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_streaming, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_progress_interval, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_checksum, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_delta, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_resume, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_skip_zeros, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_limiter, false, TIMEOUT_MIN(1));
+REGISTER_TEST(data_range, false, TIMEOUT_MIN(1));
+
+#define SOURCE_FILE_NAME     	"data_engine_source"
+#define DESTINATION_FILE_NAME	"data_engine_destination"
+
+#define FILE_SIZE	(8 * MB + 3 * KB)	// not a multiple of any block size
+
+#define DISK_IMAGE_SIZE_MB	32
+
+#define TUNED_FILE_SIZE	(160 * MB)	// large enough to settle on an I/O size
+
+#define CHECKPOINT_XATTR_NAME	"com.apple.copyfile.checkpoint"
+
+typedef struct data_cb_ctx {
+	off_t last_copied;
+	uint32_t progress_cb_calls;
+} data_cb_ctx_t;
+
+static int data_progress_cb(int what, int stage, copyfile_state_t state,
+	__unused const char *src, __unused const char *dst, void *ctxp) {
+	data_cb_ctx_t *ctx = (data_cb_ctx_t *)ctxp;
+	off_t copied;
+
+	assert_equal_int(what, COPYFILE_COPY_DATA);
+	assert_equal_int(stage, COPYFILE_PROGRESS);
+
+	// COPYFILE_STATE_COPIED must only ever increase.
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_COPIED, &copied));
+	assert(copied > ctx->last_copied);
+	ctx->last_copied = copied;
+	ctx->progress_cb_calls++;
+
+	return COPYFILE_CONTINUE;
+}
+
+static void create_data_file(const char *path, size_t size) {
+	char buf[64 * KB];
+	int fd;
+
+	assert_fd(fd = open(path, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	for (size_t written = 0; written < size; written += sizeof(buf)) {
+		size_t len = MIN(sizeof(buf), size - written);
+
+		arc4random_buf(buf, len);
+		check_io(write(fd, buf, len), (ssize_t)len);
+	}
+	assert_no_err(close(fd));
+}
+
+// Copy src to dst with the given state property set, and verify the result.
+static bool verify_data_copy(const char *src, const char *dst, uint32_t flag, uint32_t value) {
+	data_cb_ctx_t ctx = {0};
+	copyfile_state_t state;
+	off_t bytes_copied = 0;
+	uint32_t readback = 0;
+	bool success;
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CB, &data_progress_cb));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CTX, &ctx));
+	assert_no_err(copyfile_state_set(state, flag, &value));
+	assert_no_err(copyfile_state_get(state, flag, &readback));
+	assert_equal_int(readback, value);
+
+	assert_no_err(copyfile(src, dst, state, COPYFILE_DATA|COPYFILE_EXCL));
+
+	success = verify_copy_contents(src, dst);
+
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_COPIED, &bytes_copied));
+	if (bytes_copied != FILE_SIZE || ctx.last_copied != FILE_SIZE) {
+		printf("expected %llu bytes copied, found %lld (last progress %lld)\n",
+			(unsigned long long)FILE_SIZE, bytes_copied, ctx.last_copied);
+		success = false;
+	}
+	if (ctx.progress_cb_calls == 0) {
+		printf("no progress callbacks were made\n");
+		success = false;
+	}
+
+	assert_no_err(removefile(dst, NULL, 0));
+	assert_no_err(copyfile_state_free(state));
+
+	return success;
+}
+
+bool do_data_qdepth_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	int test_file_id, src_fd, dst_fd;
+	copyfile_state_t state;
+	uint32_t qdepth = 4;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	// A queue depth of 0 or 1 is the default synchronous copy;
+	// anything larger should produce identical results.
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_QUEUE_DEPTH, 1);
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_QUEUE_DEPTH, 4);
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_QUEUE_DEPTH, 64);
+
+	// fcopyfile() should start at (and advance) the current source offset.
+	assert_fd(src_fd = open(test_src, O_RDONLY));
+	assert_fd(dst_fd = open(test_dst, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	assert_with_errno(lseek(src_fd, MB, SEEK_SET) == (off_t)MB);
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_QUEUE_DEPTH, &qdepth));
+	assert_no_err(fcopyfile(src_fd, dst_fd, state, COPYFILE_DATA));
+	assert_equal_ll(lseek(src_fd, 0, SEEK_CUR), (off_t)FILE_SIZE);
+	assert_equal_ll(lseek(dst_fd, 0, SEEK_CUR), (off_t)(FILE_SIZE - MB));
+	success &= verify_fd_contents(src_fd, MB, dst_fd, 0, 64 * KB);
+	success &= verify_fd_contents(src_fd, FILE_SIZE - 64 * KB, dst_fd, FILE_SIZE - MB - 64 * KB, 64 * KB);
+
+	assert_no_err(copyfile_state_free(state));
+	assert_no_err(close(dst_fd));
+	assert_no_err(close(src_fd));
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_data_threads_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	int test_file_id, src_fd, dst_fd;
+	copyfile_state_t state;
+	uint32_t nthreads = 4;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_THREADS, 1);
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_THREADS, 3);
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_THREADS, 128);
+
+	// fcopyfile() should start at (and advance) the current source offset.
+	assert_fd(src_fd = open(test_src, O_RDONLY));
+	assert_fd(dst_fd = open(test_dst, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	assert_with_errno(lseek(src_fd, 3 * MB, SEEK_SET) == (off_t)(3 * MB));
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_THREADS, &nthreads));
+	assert_no_err(fcopyfile(src_fd, dst_fd, state, COPYFILE_DATA));
+	assert_equal_ll(lseek(src_fd, 0, SEEK_CUR), (off_t)FILE_SIZE);
+	assert_equal_ll(lseek(dst_fd, 0, SEEK_CUR), (off_t)(FILE_SIZE - 3 * MB));
+	success &= verify_fd_contents(src_fd, 3 * MB, dst_fd, 0, 64 * KB);
+	success &= verify_fd_contents(src_fd, FILE_SIZE - 64 * KB, dst_fd, FILE_SIZE - 3 * MB - 64 * KB, 64 * KB);
+
+	assert_no_err(copyfile_state_free(state));
+	assert_no_err(close(dst_fd));
+	assert_no_err(close(src_fd));
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_data_pipeline_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+#if TARGET_OS_OSX
+	char dmg_mount_dir[BSIZE_B] = {0}, test_dst_external[BSIZE_B] = {0};
+#endif
+	int test_file_id;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	// On the same device, the pipeline is not used.
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_PIPELINE, 0);
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_PIPELINE, 1);
+
+#if TARGET_OS_OSX
+	// Copy to a different device, where it is.
+	create_test_file_name(apfs_test_directory, "data_engine_mount", test_file_id, dmg_mount_dir);
+	assert_with_errno(snprintf(test_dst_external, BSIZE_B, "%s/dst", dmg_mount_dir) > 0);
+	assert_no_err(mkdir(dmg_mount_dir, DEFAULT_MKDIR_PERM));
+	disk_image_create(APFS_FSTYPE, dmg_mount_dir, DISK_IMAGE_SIZE_MB);
+
+	success &= verify_data_copy(test_src, test_dst_external, COPYFILE_STATE_PIPELINE, 1);
+
+	disk_image_destroy(dmg_mount_dir, false);
+	(void)removefile(dmg_mount_dir, NULL, REMOVEFILE_RECURSIVE);
+#endif
+
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_data_mmap_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	const off_t thresholds[] = {0, 1, FILE_SIZE, FILE_SIZE + 1};
+	int test_file_id, src_fd, dst_fd;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	// Whether or not the file is at least as large as the threshold,
+	// fcopyfile() should produce the same results from any source offset.
+	for (size_t i = 0; i < sizeof(thresholds) / sizeof(thresholds[0]); i++) {
+		data_cb_ctx_t ctx = {0};
+		copyfile_state_t state;
+		off_t threshold = 0;
+
+		assert_fd(src_fd = open(test_src, O_RDONLY));
+		assert_fd(dst_fd = open(test_dst, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+		assert_with_errno(lseek(src_fd, 5 * KB, SEEK_SET) == (off_t)(5 * KB));
+
+		assert_with_errno((state = copyfile_state_alloc()));
+		assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CB, &data_progress_cb));
+		assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CTX, &ctx));
+		assert_no_err(copyfile_state_set(state, COPYFILE_STATE_MMAP_THRESHOLD, &thresholds[i]));
+		assert_no_err(copyfile_state_get(state, COPYFILE_STATE_MMAP_THRESHOLD, &threshold));
+		assert_equal_ll(threshold, thresholds[i]);
+
+		assert_no_err(fcopyfile(src_fd, dst_fd, state, COPYFILE_DATA));
+		assert_equal_ll(lseek(src_fd, 0, SEEK_CUR), (off_t)FILE_SIZE);
+		assert_equal_ll(lseek(dst_fd, 0, SEEK_CUR), (off_t)(FILE_SIZE - 5 * KB));
+		assert_equal_ll(ctx.last_copied, (off_t)(FILE_SIZE - 5 * KB));
+		success &= verify_fd_contents(src_fd, 5 * KB, dst_fd, 0, 64 * KB);
+		success &= verify_fd_contents(src_fd, FILE_SIZE - 64 * KB, dst_fd, FILE_SIZE - 5 * KB - 64 * KB, 64 * KB);
+
+		assert_no_err(copyfile_state_free(state));
+		assert_no_err(close(dst_fd));
+		assert_no_err(close(src_fd));
+		assert_no_err(removefile(test_dst, NULL, 0));
+	}
+
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Copy src to dst with COPYFILE_STATE_ADAPTIVE_BSIZE set, returning the size it settled on.
+static uint32_t adaptive_copy(const char *src, const char *dst) {
+	copyfile_state_t state;
+	uint32_t adaptive = 1, tuned_bsize = UINT32_MAX;
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_ADAPTIVE_BSIZE, &adaptive));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_ADAPTIVE_BSIZE, &adaptive));
+	assert_equal_int(adaptive, 1);
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_TUNED_BSIZE, &tuned_bsize), EINVAL);
+
+	assert_no_err(copyfile(src, dst, state, COPYFILE_DATA|COPYFILE_EXCL));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_TUNED_BSIZE, &tuned_bsize));
+
+	assert_no_err(copyfile_state_free(state));
+
+	return tuned_bsize;
+}
+
+bool do_data_adaptive_bsize_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	uint32_t tuned_bsize;
+	int test_file_id;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+
+	// A small file is not worth tuning with.
+	create_data_file(test_src, FILE_SIZE);
+	assert_equal_int(adaptive_copy(test_src, test_dst), 0);
+	success &= verify_copy_contents(test_src, test_dst);
+	assert_no_err(removefile(test_dst, NULL, 0));
+	assert_no_err(removefile(test_src, NULL, 0));
+
+	// A large one should settle on a power-of-two size within our bounds...
+	create_data_file(test_src, TUNED_FILE_SIZE);
+	tuned_bsize = adaptive_copy(test_src, test_dst);
+	if (tuned_bsize < 64 * KB || tuned_bsize > 16 * MB || (tuned_bsize & (tuned_bsize - 1)) != 0) {
+		printf("unexpected tuned block size %u\n", tuned_bsize);
+		success = false;
+	}
+	success &= verify_copy_contents(test_src, test_dst);
+	assert_no_err(removefile(test_dst, NULL, 0));
+
+	// ...and the next copy between the same devices should reuse it.
+	assert_equal_int(adaptive_copy(test_src, test_dst), tuned_bsize);
+	success &= verify_copy_contents(test_src, test_dst);
+
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_data_nocache_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	int test_file_id, src_fd, dst_fd;
+	copyfile_state_t state;
+	uint32_t nocache = 1, bsize = 100 * KB + 1;	// not a multiple of any block size
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_NOCACHE, 1);
+
+	// fcopyfile() from an unaligned offset with an unaligned block size
+	// should produce the same results as it would through the cache.
+	assert_fd(src_fd = open(test_src, O_RDONLY));
+	assert_fd(dst_fd = open(test_dst, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	assert_with_errno(lseek(src_fd, 5 * KB + 1, SEEK_SET) == (off_t)(5 * KB + 1));
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_NOCACHE, &nocache));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_BSIZE, &bsize));
+	assert_no_err(fcopyfile(src_fd, dst_fd, state, COPYFILE_DATA));
+	assert_equal_ll(lseek(src_fd, 0, SEEK_CUR), (off_t)FILE_SIZE);
+	assert_equal_ll(lseek(dst_fd, 0, SEEK_CUR), (off_t)(FILE_SIZE - 5 * KB - 1));
+	success &= verify_fd_contents(src_fd, 5 * KB + 1, dst_fd, 0, 64 * KB);
+	success &= verify_fd_contents(src_fd, FILE_SIZE - 64 * KB, dst_fd, FILE_SIZE - 5 * KB - 1 - 64 * KB, 64 * KB);
+
+	assert_no_err(copyfile_state_free(state));
+	assert_no_err(close(dst_fd));
+	assert_no_err(close(src_fd));
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_data_streaming_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	int test_file_id;
+	copyfile_state_t state;
+	uint32_t streaming = 1;
+	bool streamed = false;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_STREAMING, 1);
+
+	// We should be told whether the copy was streamed.
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile(test_src, test_dst, state, COPYFILE_DATA|COPYFILE_EXCL));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_WAS_STREAMED, &streamed));
+	assert(!streamed);
+	assert_no_err(removefile(test_dst, NULL, 0));
+
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STREAMING, &streaming));
+	assert_no_err(copyfile(test_src, test_dst, state, COPYFILE_DATA|COPYFILE_EXCL));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_WAS_STREAMED, &streamed));
+	assert(streamed);
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_WAS_STREAMED, &streamed), EINVAL);
+	success &= verify_copy_contents(test_src, test_dst);
+
+	assert_no_err(copyfile_state_free(state));
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Copy src to dst with the given progress intervals, returning the number of progress callbacks.
+static uint32_t interval_copy(const char *src, const char *dst, off_t bytes, uint32_t msecs) {
+	data_cb_ctx_t ctx = {0};
+	copyfile_state_t state;
+	uint32_t bsize = 64 * KB;
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CB, &data_progress_cb));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CTX, &ctx));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_BSIZE, &bsize));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_PROGRESS_BYTES, &bytes));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_PROGRESS_MSECS, &msecs));
+
+	assert_no_err(copyfile(src, dst, state, COPYFILE_DATA|COPYFILE_EXCL));
+
+	// The last callback must always reflect the whole copy.
+	assert_equal_ll(ctx.last_copied, (off_t)FILE_SIZE);
+	assert_no_err(copyfile_state_free(state));
+	assert_no_err(removefile(dst, NULL, 0));
+
+	return ctx.progress_cb_calls;
+}
+
+bool do_data_progress_interval_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	copyfile_state_t state;
+	off_t bytes = 0;
+	uint32_t msecs = 0, calls;
+	int test_file_id;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_PROGRESS_BYTES, &bytes));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_PROGRESS_MSECS, &msecs));
+	assert_equal_ll(bytes, 0LL);
+	assert_equal_int(msecs, 0);
+	assert_no_err(copyfile_state_free(state));
+
+	// By default, every (64 KB) write is reported.
+	calls = interval_copy(test_src, test_dst, 0, 0);
+	if (calls != ((FILE_SIZE + 64 * KB - 1) / (64 * KB))) {
+		printf("expected %llu progress callbacks, got %u\n",
+			(unsigned long long)((FILE_SIZE + 64 * KB - 1) / (64 * KB)), calls);
+		success = false;
+	}
+
+	// With a byte interval, at most one per megabyte (plus the last).
+	calls = interval_copy(test_src, test_dst, MB, 0);
+	if (calls < FILE_SIZE / MB || calls > FILE_SIZE / MB + 1) {
+		printf("expected about %llu progress callbacks, got %u\n",
+			(unsigned long long)(FILE_SIZE / MB), calls);
+		success = false;
+	}
+
+	// With a long enough time interval, only the last.
+	calls = interval_copy(test_src, test_dst, 0, 60 * 1000);
+	if (calls != 1) {
+		printf("expected only a final progress callback, got %u\n", calls);
+		success = false;
+	}
+
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// A straightforward CRC-32C of the contents of fd from offset to its end.
+static uint32_t fd_crc32c(int fd, off_t offset) {
+	char buf[64 * KB];
+	uint32_t crc = ~0U;
+	ssize_t nread;
+
+	while ((nread = pread(fd, buf, sizeof(buf), offset)) > 0) {
+		for (ssize_t i = 0; i < nread; i++) {
+			crc ^= (uint8_t)buf[i];
+			for (int k = 0; k < 8; k++)
+				crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		}
+		offset += nread;
+	}
+	assert_with_errno(nread == 0);
+
+	return ~crc;
+}
+
+// Copy src to dst with a CRC-32C checksum requested, returning it.
+static uint32_t checksum_copy(int src_fd, int dst_fd, copyfile_flags_t flags) {
+	copyfile_state_t state;
+	uint32_t alg = COPYFILE_CHECKSUM_CRC32C, checksum = 0;
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_CHECKSUM_ALG, &alg));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_CHECKSUM_ALG, &alg));
+	assert_equal_int(alg, COPYFILE_CHECKSUM_CRC32C);
+	assert_no_err(fcopyfile(src_fd, dst_fd, state, flags));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_CHECKSUM, &checksum));
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_CHECKSUM, &checksum), EINVAL);
+	assert_no_err(copyfile_state_free(state));
+
+	return checksum;
+}
+
+bool do_data_checksum_test(const char *apfs_test_directory, size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	int test_file_id, src_fd, dst_fd;
+	copyfile_state_t state;
+	uint32_t alg = COPYFILE_CHECKSUM_CRC32C + 1, expected, checksum;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	// Unknown algorithms are rejected.
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_CHECKSUM_ALG, &alg), EINVAL);
+	assert_no_err(copyfile_state_free(state));
+
+	// Punch holes at the start and in the middle of the source,
+	// leaving a (partial) block of data at the end.
+	assert_fd(src_fd = open(test_src, O_RDWR));
+	assert_no_err(create_hole_in_fd(src_fd, 0, block_size));
+	assert_no_err(create_hole_in_fd(src_fd, 16 * block_size, 32 * block_size));
+	expected = fd_crc32c(src_fd, 0);
+
+	// A full copy and a sparse one should agree with the source's contents...
+	assert_fd(dst_fd = open(test_dst, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	checksum = checksum_copy(src_fd, dst_fd, COPYFILE_DATA);
+	assert_equal_int(checksum, expected);
+	assert_equal_int(fd_crc32c(dst_fd, 0), expected);
+	assert_no_err(close(dst_fd));
+	assert_no_err(removefile(test_dst, NULL, 0));
+
+	assert_with_errno(lseek(src_fd, 0, SEEK_SET) == 0);
+	assert_fd(dst_fd = open(test_dst, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	checksum = checksum_copy(src_fd, dst_fd, COPYFILE_DATA|COPYFILE_DATA_SPARSE);
+	assert_equal_int(checksum, expected);
+	assert_equal_int(fd_crc32c(dst_fd, 0), expected);
+	assert_no_err(close(dst_fd));
+	assert_no_err(removefile(test_dst, NULL, 0));
+
+	// ...and so should a copy from part of the way through the source.
+	assert_with_errno(lseek(src_fd, 3 * KB, SEEK_SET) == (off_t)(3 * KB));
+	assert_fd(dst_fd = open(test_dst, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	checksum = checksum_copy(src_fd, dst_fd, COPYFILE_DATA);
+	assert_equal_int(checksum, fd_crc32c(src_fd, 3 * KB));
+	assert_no_err(close(dst_fd));
+
+	assert_no_err(close(src_fd));
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static off_t delta_copy(const char *src, const char *dst) {
+	copyfile_state_t state;
+	off_t copied = 0, written = -1;
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile(src, dst, state, COPYFILE_DATA|COPYFILE_DATA_DELTA));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_COPIED, &copied));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_DELTA_WRITTEN, &written));
+	assert_no_err(copyfile_state_free(state));
+
+	// Every byte of the source should have been compared.
+	assert_equal_ll(copied, (off_t)FILE_SIZE);
+
+	return written;
+}
+
+bool do_data_delta_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	const char changed[] = "changed";
+	int test_file_id, dst_fd;
+	off_t written;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	// With no destination, everything is written.
+	written = delta_copy(test_src, test_dst);
+	assert_equal_ll(written, (off_t)FILE_SIZE);
+	success &= verify_copy_contents(test_src, test_dst);
+
+	// Updating an identical destination writes nothing...
+	written = delta_copy(test_src, test_dst);
+	assert_equal_ll(written, 0LL);
+	success &= verify_copy_contents(test_src, test_dst);
+
+	// ...and updating one with a few bytes changed rewrites only their block.
+	assert_fd(dst_fd = open(test_dst, O_RDWR));
+	assert_with_errno(pwrite(dst_fd, changed, sizeof(changed), 3 * MB + 1) == (ssize_t)sizeof(changed));
+	assert_no_err(close(dst_fd));
+	written = delta_copy(test_src, test_dst);
+	assert(written > 0 && written < (off_t)FILE_SIZE);
+	success &= verify_copy_contents(test_src, test_dst);
+
+	// A destination that is too short has its tail written...
+	assert_no_err(truncate(test_dst, FILE_SIZE / 2));
+	written = delta_copy(test_src, test_dst);
+	assert(written >= (off_t)(FILE_SIZE - FILE_SIZE / 2) && written < (off_t)FILE_SIZE);
+	success &= verify_copy_contents(test_src, test_dst);
+
+	// ...and one that is too long is truncated, without writing anything.
+	assert_no_err(truncate(test_dst, FILE_SIZE + 5 * MB));
+	written = delta_copy(test_src, test_dst);
+	assert_equal_ll(written, 0LL);
+	success &= verify_copy_contents(test_src, test_dst);
+
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int quit_progress_cb(int what, int stage, copyfile_state_t state,
+	__unused const char *src, __unused const char *dst, void *ctxp) {
+	off_t quit_after = *(off_t *)ctxp, copied;
+
+	if (what != COPYFILE_COPY_DATA || stage != COPYFILE_PROGRESS)
+		return COPYFILE_CONTINUE;
+
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_COPIED, &copied));
+	return (quit_after > 0 && copied >= quit_after) ? COPYFILE_QUIT : COPYFILE_CONTINUE;
+}
+
+// Copy src to dst, checkpointing every MB and giving up once quit_after bytes
+// have been copied (if non-zero). Returns the offset the copy resumed from.
+static off_t resumable_copy(const char *src, const char *dst, off_t quit_after) {
+	copyfile_state_t state;
+	off_t checkpoint_bytes = 1 * MB, resumed = -1;
+	uint32_t bsize = 256 * KB;
+	int rc;
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_BSIZE, &bsize));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_CHECKPOINT_BYTES, &checkpoint_bytes));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CB, &quit_progress_cb));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CTX, &quit_after));
+
+	rc = copyfile(src, dst, state, COPYFILE_DATA);
+	if (quit_after > 0) {
+		assert_equal_int(rc, -1);
+		assert_equal_int(errno, ECANCELED);
+	} else {
+		assert_no_err(rc);
+	}
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_RESUMED_OFFSET, &resumed));
+	assert_no_err(copyfile_state_free(state));
+
+	return resumed;
+}
+
+bool do_data_resume_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	struct timespec times[2] = {{0, UTIME_OMIT}, {0, 0}};
+	off_t negative = -1, resumed;
+	copyfile_state_t state;
+	struct stat dst_sb;
+	int test_file_id;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_CHECKPOINT_BYTES, &negative), EINVAL);
+	assert_no_err(copyfile_state_free(state));
+
+	// An interrupted copy leaves its partial destination and a checkpoint behind...
+	resumed = resumable_copy(test_src, test_dst, 4 * MB);
+	assert_equal_ll(resumed, 0LL);
+	assert_no_err(stat(test_dst, &dst_sb));
+	assert(dst_sb.st_size >= (off_t)(1 * MB) && dst_sb.st_size < (off_t)FILE_SIZE);
+	assert(getxattr(test_dst, CHECKPOINT_XATTR_NAME, NULL, 0, 0, 0) > 0);
+
+	// ...which the next copy picks up from, removing the checkpoint once it completes.
+	resumed = resumable_copy(test_src, test_dst, 0);
+	assert(resumed >= (off_t)(1 * MB) && resumed <= dst_sb.st_size);
+	success &= verify_copy_contents(test_src, test_dst);
+	success &= verify_path_missing_xattr(test_dst, CHECKPOINT_XATTR_NAME);
+
+	// A checkpoint is not used once the source has changed.
+	assert_no_err(removefile(test_dst, NULL, 0));
+	(void)resumable_copy(test_src, test_dst, 4 * MB);
+	assert_no_err(utimensat(AT_FDCWD, test_src, times, 0));
+	resumed = resumable_copy(test_src, test_dst, 0);
+	assert_equal_ll(resumed, 0LL);
+	success &= verify_copy_contents(test_src, test_dst);
+	success &= verify_path_missing_xattr(test_dst, CHECKPOINT_XATTR_NAME);
+
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_data_skip_zeros_test(const char *apfs_test_directory, size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	copyfile_state_t state;
+	uint32_t skip_zeros = 1;
+	char *zeros;
+	struct stat src_sb, dst_sb;
+	int test_file_id, src_fd, dst_fd;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	// Write out (rather than punch) zeros at the start, in the middle
+	// and at the end of the source, so that it is dense but mostly zero,
+	// and has a zero block straddling each of the middle region's boundaries.
+	assert_with_errno((zeros = calloc(1, 4 * MB)));
+	assert_fd(src_fd = open(test_src, O_RDWR));
+	check_io(pwrite(src_fd, zeros, 1 * MB, 0), (ssize_t)(1 * MB));
+	check_io(pwrite(src_fd, zeros, 4 * MB, 2 * MB + block_size / 2), (ssize_t)(4 * MB));
+	check_io(pwrite(src_fd, zeros, 1 * MB + 3 * KB, 7 * MB), (ssize_t)(1 * MB + 3 * KB));
+	assert_no_err(fstat(src_fd, &src_sb));
+	assert_no_err(close(src_fd));
+	free(zeros);
+
+	success &= verify_data_copy(test_src, test_dst, COPYFILE_STATE_SKIP_ZEROS, 1);
+
+	// The copy should have holes where the source had whole blocks of zeros.
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_SKIP_ZEROS, &skip_zeros));
+	assert_no_err(copyfile(test_src, test_dst, state, COPYFILE_DATA|COPYFILE_EXCL));
+	assert_no_err(copyfile_state_free(state));
+	success &= verify_copy_contents(test_src, test_dst);
+	assert_no_err(stat(test_dst, &dst_sb));
+	assert_equal_ll(dst_sb.st_size, src_sb.st_size);
+	if (dst_sb.st_blocks * S_BLKSIZE > 3 * MB) {
+		printf("%s: expected at most 3 MB allocated, found %lld bytes\n",
+			test_dst, (long long)(dst_sb.st_blocks * S_BLKSIZE));
+		success = false;
+	}
+	assert_no_err(removefile(test_dst, NULL, 0));
+
+	// Where the destination already has data, the zeros must be written out
+	// rather than let that show through: whether it is a caller's descriptor...
+	create_data_file(test_dst, FILE_SIZE);
+	assert_fd(src_fd = open(test_src, O_RDONLY));
+	assert_fd(dst_fd = open(test_dst, O_RDWR));
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_SKIP_ZEROS, &skip_zeros));
+	assert_no_err(fcopyfile(src_fd, dst_fd, state, COPYFILE_DATA));
+	assert_no_err(copyfile_state_free(state));
+	assert_no_err(close(dst_fd));
+	assert_no_err(close(src_fd));
+	success &= verify_copy_contents(test_src, test_dst);
+	assert_no_err(removefile(test_dst, NULL, 0));
+
+	// ...or one being updated in place.
+	create_data_file(test_dst, FILE_SIZE);
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_SKIP_ZEROS, &skip_zeros));
+	assert_no_err(copyfile(test_src, test_dst, state, COPYFILE_DATA|COPYFILE_DATA_DELTA));
+	assert_no_err(copyfile_state_free(state));
+	success &= verify_copy_contents(test_src, test_dst);
+
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Copy src to dst with the given state, returning how long it took (in seconds).
+static double timed_copy(const char *src, const char *dst, copyfile_state_t state) {
+	uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+	assert_no_err(copyfile(src, dst, state, COPYFILE_DATA|COPYFILE_EXCL));
+	return (double)(clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start) / 1e9;
+}
+
+bool do_data_limiter_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0};
+	copyfile_state_t state, shared_state;
+	copyfile_limiter_t limiter = NULL, shared = NULL;
+	off_t bytes_per_sec = 16 * MB, negative = -1, readback = 0;
+	uint32_t iops = 0;
+	double elapsed;
+	int test_file_id;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_data_file(test_src, FILE_SIZE);
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_LIMITER, &limiter));
+	assert(limiter == NULL);
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_BYTES_PER_SEC, &negative), EINVAL);
+	// Asking for no limit doesn't need (or make) a limiter.
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_BYTES_PER_SEC, &readback));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_IOPS, &iops));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_LIMITER, &limiter));
+	assert(limiter == NULL);
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_BYTES_PER_SEC, &bytes_per_sec));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_BYTES_PER_SEC, &readback));
+	assert_equal_ll(readback, bytes_per_sec);
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_IOPS, &iops));
+	assert_equal_int(iops, 0);
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_LIMITER, &limiter));
+	assert(limiter != NULL);
+
+	// At 16 MB/s (less the initial burst), the copy should take at least 0.3 seconds.
+	elapsed = timed_copy(test_src, test_dst, state);
+	success &= verify_copy_contents(test_src, test_dst);
+	assert_no_err(removefile(test_dst, NULL, 0));
+	if (elapsed < 0.3) {
+		printf("rate-limited copy took only %.3f seconds\n", elapsed);
+		success = false;
+	}
+
+	// A state sharing the limiter is held to the same rate,
+	// even once the state it came from is gone.
+	assert_with_errno((shared_state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(shared_state, COPYFILE_STATE_LIMITER, &limiter));
+	assert_no_err(copyfile_state_free(state));
+	assert_no_err(copyfile_state_get(shared_state, COPYFILE_STATE_LIMITER, &shared));
+	assert(shared == limiter);
+	assert_no_err(copyfile_state_get(shared_state, COPYFILE_STATE_BYTES_PER_SEC, &readback));
+	assert_equal_ll(readback, bytes_per_sec);
+
+	elapsed = timed_copy(test_src, test_dst, shared_state);
+	success &= verify_copy_contents(test_src, test_dst);
+	assert_no_err(removefile(test_dst, NULL, 0));
+	if (elapsed < 0.3) {
+		printf("copy sharing a limiter took only %.3f seconds\n", elapsed);
+		success = false;
+	}
+
+	// Removing the limiter removes the limit.
+	shared = NULL;
+	assert_no_err(copyfile_state_set(shared_state, COPYFILE_STATE_LIMITER, &shared));
+	assert_no_err(copyfile_state_get(shared_state, COPYFILE_STATE_BYTES_PER_SEC, &readback));
+	assert_equal_ll(readback, 0LL);
+	assert_no_err(copyfile_state_free(shared_state));
+
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Copy length bytes at src_offset in src_fd to dst_offset in dst_fd.
+static void range_copy(int src_fd, int dst_fd, off_t src_offset, off_t dst_offset, off_t length,
+	copyfile_flags_t flags, uint32_t skip_zeros) {
+	copyfile_state_t state;
+	off_t copied = 0;
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RANGE_SRC_OFFSET, &src_offset));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RANGE_DST_OFFSET, &dst_offset));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RANGE_LENGTH, &length));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_SKIP_ZEROS, &skip_zeros));
+	assert_no_err(fcopyfile(src_fd, dst_fd, state, flags));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_COPIED, &copied));
+	assert_equal_ll(copied, length);
+	assert_no_err(copyfile_state_free(state));
+}
+
+// Copy length bytes at src_offset in src to dst_offset in an existing dst
+// by path, checking that everything in dst outside of the range survives.
+static bool path_range_copy(const char *src, const char *dst, int src_fd, int dst_fd,
+	off_t src_offset, off_t dst_offset, off_t length) {
+	copyfile_state_t state;
+	struct stat dst_sb;
+	off_t dst_size, copied = 0;
+	char *before, *after;
+	bool success;
+
+	assert_no_err(fstat(dst_fd, &dst_sb));
+	dst_size = dst_sb.st_size;
+	assert(dst_offset + length <= dst_size);
+	assert_with_errno((before = malloc((size_t)dst_size)));
+	assert_with_errno((after = malloc((size_t)dst_size)));
+	check_io(pread(dst_fd, before, (size_t)dst_size, 0), (ssize_t)dst_size);
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RANGE_SRC_OFFSET, &src_offset));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RANGE_DST_OFFSET, &dst_offset));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RANGE_LENGTH, &length));
+	assert_no_err(copyfile(src, dst, state, COPYFILE_DATA));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_COPIED, &copied));
+	assert_equal_ll(copied, length);
+	assert_no_err(copyfile_state_free(state));
+
+	// dst_fd still refers to the destination, as it was not replaced.
+	assert_no_err(fstat(dst_fd, &dst_sb));
+	assert_equal_ll(dst_sb.st_size, dst_size);
+	check_io(pread(dst_fd, after, (size_t)dst_size, 0), (ssize_t)dst_size);
+	success = (memcmp(before, after, (size_t)dst_offset) == 0 &&
+		memcmp(before + dst_offset + length, after + dst_offset + length,
+			(size_t)(dst_size - dst_offset - length)) == 0);
+	success &= verify_fd_contents(src_fd, src_offset, dst_fd, dst_offset, (size_t)length);
+
+	free(after);
+	free(before);
+	return success;
+}
+
+bool do_data_range_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char test_src[BSIZE_B] = {0}, test_dst[BSIZE_B] = {0}, test_sparse[BSIZE_B] = {0};
+	const off_t half = FILE_SIZE / 2 + 5;
+	off_t negative = -1, past_end = FILE_SIZE + 1, length = 1 * MB, copied = -1;
+	copyfile_state_t state;
+	struct stat dst_sb;
+	char *zeros;
+	int test_file_id, src_fd, dst_fd, sparse_fd;
+	bool success = true;
+
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, SOURCE_FILE_NAME, test_file_id, test_src);
+	create_test_file_name(apfs_test_directory, DESTINATION_FILE_NAME, test_file_id, test_dst);
+	create_test_file_name(apfs_test_directory, "data_engine_sparse", test_file_id, test_sparse);
+	create_data_file(test_src, FILE_SIZE);
+
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_RANGE_SRC_OFFSET, &negative), EINVAL);
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_RANGE_DST_OFFSET, &negative), EINVAL);
+	assert_call_fail(copyfile_state_set(state, COPYFILE_STATE_RANGE_LENGTH, &negative), EINVAL);
+	assert_no_err(copyfile_state_free(state));
+
+	assert_fd(src_fd = open(test_src, O_RDONLY));
+	assert_fd(dst_fd = open(test_dst, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	assert_with_errno(lseek(src_fd, 7, SEEK_SET) == 7);
+
+	// Assemble the destination back to front, from two ranges...
+	range_copy(src_fd, dst_fd, half, half, FILE_SIZE - half, COPYFILE_DATA, 0);
+	assert_no_err(fstat(dst_fd, &dst_sb));
+	assert_equal_ll(dst_sb.st_size, (off_t)FILE_SIZE);
+	range_copy(src_fd, dst_fd, 0, 0, half, COPYFILE_DATA, 0);
+	assert_no_err(fstat(dst_fd, &dst_sb));
+	assert_equal_ll(dst_sb.st_size, (off_t)FILE_SIZE);
+	success &= verify_copy_contents(test_src, test_dst);
+
+	// ...without moving either file's offset.
+	assert_equal_ll(lseek(src_fd, 0, SEEK_CUR), 7LL);
+	assert_equal_ll(lseek(dst_fd, 0, SEEK_CUR), 0LL);
+
+	// A range past the end of the source copies nothing.
+	assert_with_errno((state = copyfile_state_alloc()));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RANGE_SRC_OFFSET, &past_end));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RANGE_LENGTH, &length));
+	assert_no_err(fcopyfile(src_fd, dst_fd, state, COPYFILE_DATA));
+	assert_no_err(copyfile_state_get(state, COPYFILE_STATE_COPIED, &copied));
+	assert_equal_ll(copied, 0LL);
+	assert_no_err(copyfile_state_free(state));
+	assert_no_err(fstat(dst_fd, &dst_sb));
+	assert_equal_ll(dst_sb.st_size, (off_t)FILE_SIZE);
+
+	// Copying the start of the source over the end of the destination
+	// extends it, but never truncates it.
+	range_copy(src_fd, dst_fd, 0, FILE_SIZE - 1 * KB, 4 * KB, COPYFILE_DATA, 0);
+	assert_no_err(fstat(dst_fd, &dst_sb));
+	assert_equal_ll(dst_sb.st_size, (off_t)(FILE_SIZE + 3 * KB));
+	success &= verify_fd_contents(src_fd, 0, dst_fd, FILE_SIZE - 1 * KB, 4 * KB);
+	range_copy(src_fd, dst_fd, 0, 0, 1 * KB, COPYFILE_DATA, 0);
+	assert_no_err(fstat(dst_fd, &dst_sb));
+	assert_equal_ll(dst_sb.st_size, (off_t)(FILE_SIZE + 3 * KB));
+
+	// A sparse range copy over data already in the destination must not
+	// leave that data showing through where the source has a hole
+	// (its first and third megabytes) or a block of zeros (its second).
+	assert_fd(sparse_fd = open(test_sparse, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM));
+	assert_with_errno((zeros = calloc(1, 1 * MB)));
+	check_io(pwrite(sparse_fd, zeros, 1 * MB, 1 * MB), (ssize_t)(1 * MB));
+	check_io(pwrite(sparse_fd, "x", 1, 4 * MB - 1), 1);
+	assert_no_err(create_hole_in_fd(sparse_fd, 0, 1 * MB));
+	assert_no_err(create_hole_in_fd(sparse_fd, 2 * MB, 1 * MB));
+	free(zeros);
+
+	range_copy(sparse_fd, dst_fd, 0, 0, 4 * MB, COPYFILE_DATA|COPYFILE_DATA_SPARSE, 0);
+	success &= verify_fd_contents(sparse_fd, 0, dst_fd, 0, 4 * MB);
+	range_copy(src_fd, dst_fd, 0, 0, 4 * MB, COPYFILE_DATA, 0);
+	range_copy(sparse_fd, dst_fd, 0, 0, 4 * MB, COPYFILE_DATA|COPYFILE_DATA_SPARSE, 1);
+	success &= verify_fd_contents(sparse_fd, 0, dst_fd, 0, 4 * MB);
+
+	// Past the end of the destination, there is nothing to show through.
+	range_copy(sparse_fd, dst_fd, 0, FILE_SIZE + 3 * KB, 4 * MB, COPYFILE_DATA|COPYFILE_DATA_SPARSE, 1);
+	success &= verify_fd_contents(sparse_fd, 0, dst_fd, FILE_SIZE + 3 * KB, 4 * MB);
+
+	// copyfile() must not truncate an existing destination either.
+	success &= path_range_copy(test_src, test_dst, src_fd, dst_fd, 5, 2 * KB, 1 * KB);
+
+	assert_no_err(close(sparse_fd));
+	assert_no_err(close(dst_fd));
+	assert_no_err(close(src_fd));
+	(void)removefile(test_sparse, NULL, 0);
+	(void)removefile(test_dst, NULL, 0);
+	(void)removefile(test_src, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -3,6 +3,7 @@
 //  copyfile_test
 //
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +20,8 @@ REGISTER_TEST(recursive_symlink_overwrite, false, TIMEOUT_MIN(1));
 REGISTER_TEST(recursive_with_symlink, false, TIMEOUT_MIN(1));
 REGISTER_TEST(recursive_symlink_root, false, TIMEOUT_MIN(1));
 REGISTER_TEST(path_input, false, TIMEOUT_MIN(1));
+REGISTER_TEST(recursive_parallel, false, TIMEOUT_MIN(2));
+REGISTER_TEST(recursive_skipped_symlink, false, TIMEOUT_MIN(1));
 
 bool do_recursive_symlink_overwrite_test(const char *apfs_test_directory, __unused size_t block_size) {
 	int file_src_fd, test_file_id;
@@ -126,6 +129,8 @@ static int recursive_with_symlink_callback(int what, __unused int stage, copyfil
 		// and the one file (and only see a link if we're expecting one).
 		assert(ctx->has_link);
 		assert((ctx->rc_dirs_found == num_directories) && ctx->rc_file_found && !ctx->rc_link_found);
+		// Links are copied after the walk, from a copy of their entry.
+		assert(entry->fts_parent == NULL && entry->fts_level > 0);
 		ctx->rc_link_found = true;
 	} else if (entry->fts_info == FTS_DP) {
 		// Make sure we only see this after we've seen a directory and not the link
@@ -418,3 +423,194 @@ bool do_path_input_test(const char *apfs_test_directory, __unused size_t block_s
 
 	return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
+
+#define PARALLEL_DIRS	4
+#define PARALLEL_FILES	32
+
+typedef struct {
+	atomic_int	in_callback;	// callbacks being made right now
+	bool		overlapped;	// a callback was made while another was
+	int		files_started;
+	int		files_finished;
+	int		dirs_cleaned;
+	int		quit_at;	// if > 0, quit when this many files have been started
+} parallel_ctx_t;
+
+static int recursive_parallel_callback(int what, int stage, __unused copyfile_state_t state,
+	__unused const char *src, const char *dst, void *ctx) {
+	parallel_ctx_t *pctx = ctx;
+	int rv = COPYFILE_CONTINUE;
+
+	if (atomic_fetch_add(&pctx->in_callback, 1) != 0) {
+		pctx->overlapped = true;
+	}
+
+	if (what == COPYFILE_RECURSE_FILE && stage == COPYFILE_START) {
+		if (++pctx->files_started == pctx->quit_at) {
+			rv = COPYFILE_QUIT;
+		}
+	} else if (what == COPYFILE_RECURSE_FILE && stage == COPYFILE_FINISH) {
+		pctx->files_finished++;
+	} else if (what == COPYFILE_RECURSE_DIR_CLEANUP && stage == COPYFILE_START) {
+		// Every file in the directory must have been copied by now.
+		struct stat sb;
+		char path[BSIZE_B];
+
+		assert_with_errno(snprintf(path, BSIZE_B, "%s/file%d", dst, PARALLEL_FILES - 1) > 0);
+		if (stat(path, &sb) == 0 && sb.st_size == PARALLEL_FILES) {
+			pctx->dirs_cleaned++;
+		}
+	}
+
+	atomic_fetch_sub(&pctx->in_callback, 1);
+	return rv;
+}
+
+bool do_recursive_parallel_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char src_root[BSIZE_B], dst_root[BSIZE_B], path[BSIZE_B], dst_path[BSIZE_B];
+	parallel_ctx_t pctx = { .overlapped = false };
+	copyfile_state_t state;
+	uint32_t nthreads = 8;
+	bool success = true;
+	int fd;
+
+	// Construct our source layout:
+	//
+	// apfs_test_directory
+	//   parallel_src
+	//     dir0 .. dir3
+	//       file0 .. file31 (fileN holding N + 1 bytes)
+	//       link -> file0
+	//
+	assert_with_errno(snprintf(src_root, BSIZE_B, "%s/parallel_src", apfs_test_directory) > 0);
+	assert_with_errno(snprintf(dst_root, BSIZE_B, "%s/parallel_dst", apfs_test_directory) > 0);
+	assert_no_err(mkdir(src_root, DEFAULT_MKDIR_PERM));
+	for (int dir = 0; dir < PARALLEL_DIRS; dir++) {
+		assert_with_errno(snprintf(path, BSIZE_B, "%s/dir%d", src_root, dir) > 0);
+		assert_no_err(mkdir(path, DEFAULT_MKDIR_PERM));
+		for (int file = 0; file < PARALLEL_FILES; file++) {
+			char contents[PARALLEL_FILES];
+
+			memset(contents, 'a' + dir, sizeof(contents));
+			assert_with_errno(snprintf(path, BSIZE_B, "%s/dir%d/file%d", src_root, dir, file) > 0);
+			assert_with_errno((fd = open(path, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM)) >= 0);
+			check_io(write(fd, contents, (size_t) file + 1), file + 1);
+			assert_no_err(close(fd));
+		}
+		assert_with_errno(snprintf(path, BSIZE_B, "%s/dir%d/link", src_root, dir) > 0);
+		assert_no_err(symlink("file0", path));
+	}
+
+	// Copy it with several threads, checking that callbacks are
+	// still made one at a time, and each directory is only
+	// cleaned up once its files are all there.
+	assert_with_errno((state = copyfile_state_alloc()) != NULL);
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_RECURSIVE_THREADS, &nthreads));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CB, &recursive_parallel_callback));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CTX, &pctx));
+	assert_no_err(copyfile(src_root, dst_root, state, COPYFILE_ALL|COPYFILE_RECURSIVE));
+
+	assert(!pctx.overlapped);
+	assert_equal_int(pctx.files_started, PARALLEL_DIRS * (PARALLEL_FILES + 1));
+	assert_equal_int(pctx.files_finished, PARALLEL_DIRS * (PARALLEL_FILES + 1));
+	assert_equal_int(pctx.dirs_cleaned, PARALLEL_DIRS);
+
+	for (int dir = 0; dir < PARALLEL_DIRS; dir++) {
+		for (int file = 0; file < PARALLEL_FILES; file++) {
+			assert_with_errno(snprintf(path, BSIZE_B, "%s/dir%d/file%d", src_root, dir, file) > 0);
+			assert_with_errno(snprintf(dst_path, BSIZE_B, "%s/dir%d/file%d", dst_root, dir, file) > 0);
+			success &= verify_copy_contents(path, dst_path);
+		}
+		assert_with_errno(snprintf(dst_path, BSIZE_B, "%s/dir%d/link", dst_root, dir) > 0);
+		assert_with_errno(readlink(dst_path, path, sizeof(path)) == (ssize_t) strlen("file0"));
+	}
+	assert_no_err(removefile(dst_root, NULL, REMOVEFILE_RECURSIVE));
+
+	// Quitting from a callback must still stop the copy.
+	memset(&pctx, 0, sizeof(pctx));
+	pctx.quit_at = PARALLEL_FILES / 2;
+	assert_call_fail(copyfile(src_root, dst_root, state, COPYFILE_ALL|COPYFILE_RECURSIVE));
+	assert_equal_int(pctx.files_started, PARALLEL_FILES / 2);
+	assert(!pctx.overlapped);
+
+	assert_no_err(copyfile_state_free(state));
+	(void)removefile(dst_root, NULL, REMOVEFILE_RECURSIVE);
+	assert_no_err(removefile(src_root, NULL, REMOVEFILE_RECURSIVE));
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+typedef struct {
+	int	errors;
+	int	links_started;
+} skipped_symlink_ctx_t;
+
+static int recursive_skipped_symlink_callback(int what, int stage, __unused copyfile_state_t state,
+	const char *src, __unused const char *dst, void *ctx) {
+	skipped_symlink_ctx_t *sctx = ctx;
+	const char *name = strrchr(src, '/');
+
+	if (stage == COPYFILE_ERR) {
+		sctx->errors++;
+		return COPYFILE_CONTINUE;
+	} else if (stage != COPYFILE_START) {
+		return COPYFILE_CONTINUE;
+	}
+
+	if (what == COPYFILE_RECURSE_DIR && name && !strcmp(name, "/skipped")) {
+		return COPYFILE_SKIP;
+	} else if (what == COPYFILE_RECURSE_FILE && name && !strcmp(name, "/link")) {
+		sctx->links_started++;
+	}
+
+	return COPYFILE_CONTINUE;
+}
+
+bool do_recursive_skipped_symlink_test(const char *apfs_test_directory, __unused size_t block_size) {
+	char src_root[BSIZE_B] = {0}, dst_root[BSIZE_B] = {0};
+	char path[BSIZE_B] = {0};
+	struct stat sb;
+	copyfile_state_t state = copyfile_state_alloc();
+	skipped_symlink_ctx_t sctx = { 0 };
+
+	// Construct our source layout:
+	//
+	// apfs_test_directory
+	//   skipped_symlink_src
+	//     kept (directory)
+	//       link -> target
+	//     skipped (directory)
+	//       link -> target
+	//
+	// Symbolic links are copied after everything else, but only those
+	// in directories that were actually copied.
+	assert_with_errno(snprintf(src_root, BSIZE_B, "%s/skipped_symlink_src", apfs_test_directory) > 0);
+	assert_with_errno(snprintf(dst_root, BSIZE_B, "%s/skipped_symlink_dst", apfs_test_directory) > 0);
+	assert_no_err(mkdir(src_root, DEFAULT_MKDIR_PERM));
+	assert_with_errno(snprintf(path, BSIZE_B, "%s/kept", src_root) > 0);
+	assert_no_err(mkdir(path, DEFAULT_MKDIR_PERM));
+	assert_with_errno(snprintf(path, BSIZE_B, "%s/kept/link", src_root) > 0);
+	assert_no_err(symlink("target", path));
+	assert_with_errno(snprintf(path, BSIZE_B, "%s/skipped", src_root) > 0);
+	assert_no_err(mkdir(path, DEFAULT_MKDIR_PERM));
+	assert_with_errno(snprintf(path, BSIZE_B, "%s/skipped/link", src_root) > 0);
+	assert_no_err(symlink("target", path));
+
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CB, &recursive_skipped_symlink_callback));
+	assert_no_err(copyfile_state_set(state, COPYFILE_STATE_STATUS_CTX, (void *)&sctx));
+	assert_no_err(copyfile(src_root, dst_root, state, COPYFILE_ALL|COPYFILE_CLONE|COPYFILE_RECURSIVE));
+
+	assert_equal_int(sctx.errors, 0);
+	assert_equal_int(sctx.links_started, 1);
+	assert_with_errno(snprintf(path, BSIZE_B, "%s/kept/link", dst_root) > 0);
+	assert_no_err(lstat(path, &sb));
+	assert(S_ISLNK(sb.st_mode));
+	assert_with_errno(snprintf(path, BSIZE_B, "%s/skipped", dst_root) > 0);
+	assert_call_fail(lstat(path, &sb), ENOENT);
+
+	assert_no_err(copyfile_state_free(state));
+	(void)removefile(dst_root, NULL, REMOVEFILE_RECURSIVE);
+	assert_no_err(removefile(src_root, NULL, REMOVEFILE_RECURSIVE));
+
+	return EXIT_SUCCESS;
+}
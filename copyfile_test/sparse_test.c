@@ -15,9 +15,16 @@
 #include "test_utils.h"
 #include "systemx.h"
 
+#define DISK_IMAGE_SIZE_MB	32
+
 REGISTER_TEST(sparse, false, TIMEOUT_MIN(1));
 REGISTER_TEST(sparse_recursive, false, TIMEOUT_MIN(1));
 REGISTER_TEST(fcopyfile_offset, false, 30);
+REGISTER_TEST(fcopyfile_unaligned_offset, false, 30);
+REGISTER_TEST(sparse_parallel, false, TIMEOUT_MIN(1));
+REGISTER_TEST(sparse_skip_zeros, false, 30);
+REGISTER_TEST(sparse_bsize, false, 30);
+REGISTER_TEST(sparse_mismatched_bsize, false, TIMEOUT_MIN(1));
 
 /*
  * Copy the file pointed to by src_fd (and orig_name) to copy_name,
@@ -184,16 +191,92 @@ static off_t write_diff_adj_holes(int fd, off_t block_size) {
 	return 0;
 }
 
+static off_t write_many_data_sections(int fd, off_t block_size) {
+	// More data sections than copyfile maps at once.
+	for (off_t block = 1; block < 1024; block += 2) {
+		assert_with_errno(pwrite(fd, "x", 1, block * block_size) == 1);
+	}
+	assert_no_err(ftruncate(fd, 1024 * block_size));
+
+	for (off_t block = 0; block < 1024; block += 2) {
+		assert_no_err(create_hole_in_fd(fd, block * block_size, block_size));
+	}
+	return 0;
+}
+
+static off_t write_zero_data(int fd, off_t block_size) {
+	// Data sections that read as zeros, as preallocated space might.
+	char *zeros = calloc(4, (size_t) block_size);
+
+	assert_with_errno(zeros != NULL);
+	assert_with_errno(pwrite(fd, zeros, 4 * block_size, 0) == 4 * block_size);
+	assert_with_errno(pwrite(fd, "y", 1, 4 * block_size) == 1);
+	assert_with_errno(pwrite(fd, zeros, 4 * block_size, 8 * block_size) == 4 * block_size);
+	assert_no_err(ftruncate(fd, 16 * block_size));
+	free(zeros);
+
+	assert_no_err(create_hole_in_fd(fd, 5 * block_size, 3 * block_size));
+	assert_no_err(create_hole_in_fd(fd, 12 * block_size, 4 * block_size));
+	return 0;
+}
+
 static off_t write_nothing(__unused int fd, __unused off_t block_size) {
 	return 0;
 }
 
+/*
+ * Check that the copy at dst_fd has data wherever the source at src_fd does,
+ * and holes wherever the source does, as seen by SEEK_DATA and SEEK_HOLE;
+ * the edges of each hole may be rounded in to a multiple of dst_bsize.
+ */
+static bool verify_hole_layout(int src_fd, int dst_fd, off_t dst_bsize) {
+	struct stat src_sb;
+	off_t offset = 0, data_start, data_end, hole_start, hole_end, found;
+	bool success = true;
+
+	assert_no_err(fstat(src_fd, &src_sb));
+	while (offset < src_sb.st_size) {
+		// Find the source's next data section (if any).
+		if ((data_start = lseek(src_fd, offset, SEEK_DATA)) == -1) {
+			assert_with_errno(errno == ENXIO);
+			data_start = src_sb.st_size;
+		}
+
+		// The hole before it must be a hole in the copy.
+		hole_start = ((offset + dst_bsize - 1) / dst_bsize) * dst_bsize;
+		hole_end = (data_start / dst_bsize) * dst_bsize;
+		if (hole_start < hole_end) {
+			found = lseek(dst_fd, hole_start, SEEK_DATA);
+			if (found != -1 && found < hole_end) {
+				printf("copy has data at %lld, within source hole [%lld, %lld)\n",
+					   found, offset, data_start);
+				success = false;
+			}
+		}
+		if (data_start >= src_sb.st_size) {
+			break;
+		}
+
+		// And the data section must be data in the copy.
+		assert_with_errno((data_end = lseek(src_fd, data_start, SEEK_HOLE)) != -1);
+		found = lseek(dst_fd, data_start, SEEK_HOLE);
+		if (found < data_end) {
+			printf("copy has a hole at %lld, within source data [%lld, %lld)\n",
+				   found, data_start, data_end);
+			success = false;
+		}
+		offset = data_end;
+	}
+
+	return success;
+}
+
 typedef struct {
 	creator_func func; // pointer to function to create a sparse file
 	const char * name; // null terminated string
 } sparse_test_func;
 
-#define NUM_TEST_FUNCTIONS 11
+#define NUM_TEST_FUNCTIONS 13
 sparse_test_func sparse_test_functions[NUM_TEST_FUNCTIONS] = {
 	{write_start_and_end_holes,		"start_and_end_holes"},
 	{write_middle_hole,				"middle_hole"},
@@ -205,6 +288,8 @@ sparse_test_func sparse_test_functions[NUM_TEST_FUNCTIONS] = {
 	{write_sparse_odd_offset,		"write_sparse_odd_offset"},
 	{write_sparse_bs_offset,		"write_sparse_bs_offset"},
 	{write_diff_adj_holes,			"write_diff_adj_holes"},
+	{write_many_data_sections,		"write_many_data_sections"},
+	{write_zero_data,				"write_zero_data"},
 	{write_nothing,					"write_nothing"},
 };
 
@@ -386,3 +471,264 @@ bool do_fcopyfile_offset_test(const char *apfs_test_directory, size_t block_size
 
 	return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
+
+bool do_fcopyfile_unaligned_offset_test(const char *apfs_test_directory, size_t block_size) {
+	int src_fd, dst_fd, test_file_id;
+	char out_name[BSIZE_B], copy_name[BSIZE_B], container_byte = 0;
+	struct stat src_sb, dst_sb;
+	bool success = true;
+
+	// Make new names for this file and its copy.
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, "foff_unaligned", test_file_id, out_name);
+	create_test_file_name(apfs_test_directory, "foff_unaligned_copy", test_file_id, copy_name);
+
+	// Create the test file, with holes after its first block.
+	src_fd = open(out_name, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM);
+	assert_with_errno(src_fd >= 0);
+	(void)write_middle_and_end_holes(src_fd, block_size);
+	assert_no_err(fsync(src_fd));
+
+	// Start the copy part way into the source's first block,
+	// and place it part way into the destination's second block,
+	// after a byte that must survive the copy.
+	dst_fd = open(copy_name, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM);
+	assert_with_errno(dst_fd >= 0);
+	assert_with_errno(pwrite(dst_fd, "c", 1, block_size) == 1);
+	assert_with_errno(lseek(src_fd, 1, SEEK_SET) == 1);
+	assert_with_errno(lseek(dst_fd, block_size + 1, SEEK_SET) == (off_t) block_size + 1);
+
+	assert_no_err(fcopyfile(src_fd, dst_fd, NULL, COPYFILE_DATA|COPYFILE_DATA_SPARSE));
+
+	// The copy must match the source, and end at the end of the source.
+	assert_no_err(fstat(src_fd, &src_sb));
+	assert_no_err(fstat(dst_fd, &dst_sb));
+	assert_equal_ll(dst_sb.st_size, src_sb.st_size + (off_t) block_size);
+	success &= verify_fd_contents(src_fd, 1, dst_fd, block_size + 1, src_sb.st_size - 1);
+
+	// What came before the copy must be untouched.
+	assert_with_errno(pread(dst_fd, &container_byte, 1, block_size) == 1);
+	assert_equal_int(container_byte, 'c');
+
+	// The holes in the source must still (mostly) be holes in the copy.
+	if (dst_sb.st_blocks > src_sb.st_blocks + (off_t) (3 * block_size / S_BLKSIZE)) {
+		printf("copy blocks (%lld) > original blocks (%lld) + 3 blocks\n",
+			   dst_sb.st_blocks, src_sb.st_blocks);
+		success = false;
+	}
+
+	assert_no_err(close(dst_fd));
+	assert_no_err(close(src_fd));
+	(void)removefile(copy_name, NULL, 0);
+	(void)removefile(out_name, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_sparse_parallel_test(const char *apfs_test_directory, size_t block_size) {
+	int fd, test_file_id;
+	char out_name[BSIZE_B], copy_name[BSIZE_B];
+	struct stat orig_sb, copy_sb;
+	copyfile_state_t cpf_state;
+	uint32_t nthreads = 4;
+	bool success = true;
+
+	// Make new names for this file and its copy.
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, "sparse_parallel", test_file_id, out_name);
+	create_test_file_name(apfs_test_directory, "sparse_parallel_copy", test_file_id, copy_name);
+
+	// Create a test file with many data sections (and holes between them).
+	fd = open(out_name, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM);
+	assert_with_errno(fd >= 0);
+	(void)write_many_data_sections(fd, block_size);
+	assert_no_err(fsync(fd));
+	assert_no_err(close(fd));
+
+	// Copy it sparsely, splitting the work among several threads.
+	assert_with_errno((cpf_state = copyfile_state_alloc()) != NULL);
+	assert_no_err(copyfile_state_set(cpf_state, COPYFILE_STATE_THREADS, &nthreads));
+	assert_no_err(copyfile(out_name, copy_name, cpf_state, COPYFILE_ALL|COPYFILE_DATA_SPARSE));
+
+	// The copy must be just as sparse, and have the same contents.
+	assert_no_err(stat(out_name, &orig_sb));
+	assert_no_err(stat(copy_name, &copy_sb));
+	success &= verify_copy_sizes(&orig_sb, &copy_sb, cpf_state, true, 0);
+	success &= verify_copy_contents(out_name, copy_name);
+
+	assert_no_err(copyfile_state_free(cpf_state));
+	(void)removefile(copy_name, NULL, 0);
+	(void)removefile(out_name, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_sparse_skip_zeros_test(const char *apfs_test_directory, size_t block_size) {
+	int fd, test_file_id;
+	char out_name[BSIZE_B], copy_name[BSIZE_B];
+	struct stat orig_sb, copy_sb;
+	copyfile_state_t cpf_state;
+	uint32_t skip_zeros = 1;
+	bool success = true;
+
+	// Make new names for this file and its copy.
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, "sparse_skip_zeros", test_file_id, out_name);
+	create_test_file_name(apfs_test_directory, "sparse_skip_zeros_copy", test_file_id, copy_name);
+
+	// Create a test file whose data sections are mostly zeros.
+	fd = open(out_name, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM);
+	assert_with_errno(fd >= 0);
+	(void)write_zero_data(fd, block_size);
+	assert_no_err(fsync(fd));
+	assert_no_err(close(fd));
+
+	// Copy it sparsely, leaving the blocks of zeros unwritten.
+	assert_with_errno((cpf_state = copyfile_state_alloc()) != NULL);
+	assert_no_err(copyfile_state_set(cpf_state, COPYFILE_STATE_SKIP_ZEROS, &skip_zeros));
+	assert_no_err(copyfile(out_name, copy_name, cpf_state, COPYFILE_ALL|COPYFILE_DATA_SPARSE));
+
+	// The copy must have the same contents, and still have
+	// as much space reserved for it as the source has allocated.
+	assert_no_err(stat(out_name, &orig_sb));
+	assert_no_err(stat(copy_name, &copy_sb));
+	assert_equal_ll(copy_sb.st_size, orig_sb.st_size);
+	if (copy_sb.st_blocks < orig_sb.st_blocks) {
+		printf("copy blocks (%lld) < original blocks (%lld)\n",
+			   copy_sb.st_blocks, orig_sb.st_blocks);
+		success = false;
+	}
+	success &= verify_copy_contents(out_name, copy_name);
+
+	assert_no_err(copyfile_state_free(cpf_state));
+	(void)removefile(copy_name, NULL, 0);
+	(void)removefile(out_name, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+typedef struct {
+	uint32_t	progress_calls;
+} sparse_progress_ctx_t;
+
+static int sparse_progress_callback(int what, int stage, __unused copyfile_state_t state,
+	__unused const char *src, __unused const char *dst, void *ctx) {
+	if (what == COPYFILE_COPY_DATA && stage == COPYFILE_PROGRESS) {
+		((sparse_progress_ctx_t *)ctx)->progress_calls++;
+	}
+	return COPYFILE_CONTINUE;
+}
+
+bool do_sparse_bsize_test(const char *apfs_test_directory, __unused size_t block_size) {
+	int src_fd, dst_fd, test_file_id;
+	char out_name[BSIZE_B], copy_name[BSIZE_B];
+	sparse_progress_ctx_t ctx = {0};
+	copyfile_state_t cpf_state;
+	size_t src_bsize = 1 * MB, dst_bsize = 256 * KB;
+	char *data;
+	bool success = true;
+
+	// Make new names for this file and its copy.
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, "sparse_bsize", test_file_id, out_name);
+	create_test_file_name(apfs_test_directory, "sparse_bsize_copy", test_file_id, copy_name);
+
+	// Create a test file with two one-megabyte data sections,
+	// at 0 and 3 MB, and holes after each of them.
+	src_fd = open(out_name, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM);
+	assert_with_errno(src_fd >= 0);
+	assert_with_errno((data = malloc(1 * MB)) != NULL);
+	memset(data, 'd', 1 * MB);
+	assert_with_errno(pwrite(src_fd, data, 1 * MB, 0) == (ssize_t) (1 * MB));
+	assert_with_errno(pwrite(src_fd, data, 1 * MB, 3 * MB) == (ssize_t) (1 * MB));
+	assert_no_err(ftruncate(src_fd, 5 * MB));
+	assert_no_err(create_hole_in_fd(src_fd, 1 * MB, 2 * MB));
+	assert_no_err(create_hole_in_fd(src_fd, 4 * MB, 1 * MB));
+	assert_no_err(fsync(src_fd));
+	free(data);
+
+	// Copy it sparsely, with different source and destination block sizes:
+	// each data section should be copied in a single (source-sized) I/O,
+	// rather than a write (and progress callback) per minimum block.
+	assert_with_errno((cpf_state = copyfile_state_alloc()) != NULL);
+	assert_no_err(copyfile_state_set(cpf_state, COPYFILE_STATE_SRC_BSIZE, &src_bsize));
+	assert_no_err(copyfile_state_set(cpf_state, COPYFILE_STATE_DST_BSIZE, &dst_bsize));
+	assert_no_err(copyfile_state_set(cpf_state, COPYFILE_STATE_STATUS_CB, &sparse_progress_callback));
+	assert_no_err(copyfile_state_set(cpf_state, COPYFILE_STATE_STATUS_CTX, &ctx));
+	assert_no_err(copyfile(out_name, copy_name, cpf_state, COPYFILE_DATA|COPYFILE_DATA_SPARSE));
+	if (ctx.progress_calls != 2) {
+		printf("expected 2 progress callbacks, actually found %u\n", ctx.progress_calls);
+		success = false;
+	}
+
+	// The copy must have the same contents, and its holes in the same places.
+	dst_fd = open(copy_name, O_RDONLY);
+	assert_with_errno(dst_fd >= 0);
+	success &= verify_fd_contents(src_fd, 0, dst_fd, 0, 5 * MB);
+	success &= verify_hole_layout(src_fd, dst_fd, 1);
+
+	assert_no_err(copyfile_state_free(cpf_state));
+	assert_no_err(close(dst_fd));
+	assert_no_err(close(src_fd));
+	(void)removefile(copy_name, NULL, 0);
+	(void)removefile(out_name, NULL, 0);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool do_sparse_mismatched_bsize_test(const char *apfs_test_directory, size_t block_size) {
+	bool success = true;
+#if TARGET_OS_OSX
+	int src_fd, dst_fd, test_file_id;
+	char out_name[BSIZE_B], dmg_mount_dir[BSIZE_B] = {0}, copy_name[BSIZE_B] = {0};
+	const uint32_t dst_block_size = (block_size == 4 * KB) ? 16 * KB : 4 * KB;
+	const off_t bs = (off_t) block_size;
+	char *data;
+
+	// Make new names for this file, and for a disk image
+	// (with a different block size) to copy it onto.
+	test_file_id = rand() % DEFAULT_NAME_MOD;
+	create_test_file_name(apfs_test_directory, "sparse_mismatched", test_file_id, out_name);
+	create_test_file_name(apfs_test_directory, "sparse_mismatched_mount", test_file_id, dmg_mount_dir);
+	assert_with_errno(snprintf(copy_name, BSIZE_B, "%s/copy", dmg_mount_dir) > 0);
+	assert_no_err(mkdir(dmg_mount_dir, DEFAULT_MKDIR_PERM));
+	disk_image_create_bsize(APFS_FSTYPE, dmg_mount_dir, DISK_IMAGE_SIZE_MB, dst_block_size);
+
+	// Create a test file whose data sections start and end on the source's
+	// block boundaries, but (if its blocks are the smaller) not on the destination's:
+	// data at [1, 2) blocks and [1 MB + 1, 1 MB + 3) blocks, with holes around them.
+	src_fd = open(out_name, DEFAULT_OPEN_FLAGS, DEFAULT_OPEN_PERM);
+	assert_with_errno(src_fd >= 0);
+	assert_with_errno((data = malloc((size_t) (2 * bs))) != NULL);
+	memset(data, 'm', (size_t) (2 * bs));
+	assert_with_errno(pwrite(src_fd, data, (size_t) bs, bs) == bs);
+	assert_with_errno(pwrite(src_fd, data, (size_t) (2 * bs), 1 * MB + bs) == 2 * bs);
+	assert_no_err(ftruncate(src_fd, 2 * MB));
+	assert_no_err(create_hole_in_fd(src_fd, 0, bs));
+	assert_no_err(create_hole_in_fd(src_fd, 2 * bs, 1 * MB - bs));
+	assert_no_err(create_hole_in_fd(src_fd, 1 * MB + 3 * bs, 1 * MB - 3 * bs));
+	assert_no_err(fsync(src_fd));
+	free(data);
+
+	// Copy it sparsely onto the disk image.
+	assert_no_err(copyfile(out_name, copy_name, NULL, COPYFILE_DATA|COPYFILE_DATA_SPARSE));
+
+	// The copy must have the same contents, and its holes in the same places
+	// (give or take the destination blocks that the source's data shares).
+	dst_fd = open(copy_name, O_RDONLY);
+	assert_with_errno(dst_fd >= 0);
+	success &= verify_fd_contents(src_fd, 0, dst_fd, 0, 2 * MB);
+	success &= verify_hole_layout(src_fd, dst_fd, dst_block_size);
+
+	assert_no_err(close(dst_fd));
+	assert_no_err(close(src_fd));
+	(void)removefile(out_name, NULL, 0);
+	disk_image_destroy(dmg_mount_dir, false);
+	(void)removefile(dmg_mount_dir, NULL, REMOVEFILE_RECURSIVE);
+#else
+	(void)apfs_test_directory;
+	(void)block_size;
+#endif
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
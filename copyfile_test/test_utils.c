@@ -396,7 +396,14 @@ void sort_tests(tests_t *tests) {
 // but it can be at any path.
 // This is macOS only as hdiutil is not meaningful on iOS.
 void disk_image_create(const char *fstype, const char *mount_path, size_t size_in_mb) {
-	char size[BSIZE_B];
+	disk_image_create_bsize(fstype, mount_path, size_in_mb, 0);
+}
+
+// As disk_image_create(), but if block_size is non-zero,
+// format the disk image with that block size.
+void disk_image_create_bsize(const char *fstype, const char *mount_path, size_t size_in_mb,
+	uint32_t block_size) {
+	char size[BSIZE_B], fsargs[BSIZE_B];
 
 	// Set up good default values.
 	if (!fstype) {
@@ -411,9 +418,17 @@ void disk_image_create(const char *fstype, const char *mount_path, size_t size_i
 	disk_image_destroy(mount_path, true);
 
 	// Make the disk image.
-	assert_no_err(systemx(HDIUTIL_PATH, SYSTEMX_QUIET, "create", "-fs", fstype,
-						  "-size", size, "-type", "SPARSE", "-volname", "copyfile_test",
-						  DISK_IMAGE_PATH, NULL));
+	if (block_size == 0) {
+		assert_no_err(systemx(HDIUTIL_PATH, SYSTEMX_QUIET, "create", "-fs", fstype,
+							  "-size", size, "-type", "SPARSE", "-volname", "copyfile_test",
+							  DISK_IMAGE_PATH, NULL));
+	} else {
+		assert_with_errno(snprintf(fsargs, BSIZE_B, "-b %u", block_size) >= 4);
+		assert_no_err(systemx(HDIUTIL_PATH, SYSTEMX_QUIET, "create", "-fs", fstype,
+							  "-fsargs", fsargs,
+							  "-size", size, "-type", "SPARSE", "-volname", "copyfile_test",
+							  DISK_IMAGE_PATH, NULL));
+	}
 
 	// Attach the disk image.
 	assert_no_err(systemx(HDIUTIL_PATH, SYSTEMX_QUIET, "attach", DISK_IMAGE_PATH,
@@ -111,6 +111,8 @@ void sort_tests(tests_t *tests);
 #if TARGET_OS_OSX
 // Our disk image test functions.
 void disk_image_create(const char *fstype, const char *mount_path, size_t size_in_mb);
+void disk_image_create_bsize(const char *fstype, const char *mount_path, size_t size_in_mb,
+	uint32_t block_size);
 void disk_image_destroy(const char *mount_path, bool allow_failure);
 #endif
 